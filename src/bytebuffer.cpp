@@ -7,76 +7,125 @@
 
 #include "bytebuffer.h"
 #include "utilities.hpp"
-#include <vector>
-
-char *buff;
+#include <list>
+#include <map>
+#include <memory>
 
+// Cache of restored packets, most recently used first. Indexed by the payload of their first byte so that a lookup is
+// O(log n) and evicting the least recently used is O(1)
 typedef struct {
     uint64_t pay;
     size_t len;
-    char *buffer_offset;
+    std::unique_ptr<char[]> data;
 } buffer_t;
-std::vector<buffer_t> buffers;
 
-size_t buffer_size;
+static std::list<buffer_t> buffers;
+static std::map<uint64_t, std::list<buffer_t>::iterator> buffer_index;
+static size_t buffer_size;
+static size_t buffer_used = 0;
 
 void buffer_init(size_t mem) {
-    buff = (char *)tmalloc(mem);
     buffer_size = mem;
 }
 
 void buffer_add(const unsigned char *src, uint64_t payload, size_t len) {
-    char *insert_at = 0;
-
-    if (buffers.size() == 0) {
-        insert_at = buff;
-    } else if (buffers.back().buffer_offset - buff + buffers.back().len + len <= buffer_size) {
-        insert_at = buffers.back().buffer_offset + buffers.back().len;
-        unsigned int del = 0;
-        while (buffers.size() > 0 && buffers.size() > del && buffers[del].buffer_offset < insert_at + len && buffers[del].buffer_offset >= insert_at) {
-            del++;
-        }
-        if (del > 0) {
-            buffers.erase(buffers.begin(), buffers.begin() + del);
-        }
-    } else if (buffers.back().buffer_offset - buff + buffers.back().len + len > buffer_size) {
-        insert_at = buff;
-        int del = 0;
-        while (buffers[del].buffer_offset != buff) {
-            del++;
-        }
-        if (del > 0) {
-            buffers.erase(buffers.begin(), buffers.begin() + del);
-        }
-
-        del = 0;
-        while (buffers[del].buffer_offset < insert_at + len + 4 * 1024 * 1024) {
-            del++;
-        }
-
-        if (del > 0) {
-            buffers.erase(buffers.begin(), buffers.begin() + del);
-        }
+    if (len > buffer_size) {
+        return;
+    }
+
+    auto existing = buffer_index.find(payload);
+    if (existing != buffer_index.end() && existing->second->len == len) {
+        buffers.splice(buffers.begin(), buffers, existing->second);
+        return;
+    }
+
+    while (buffer_used + len > buffer_size || (existing != buffer_index.end() && !buffers.empty())) {
+        auto victim = existing != buffer_index.end() ? existing->second : std::prev(buffers.end());
+        buffer_index.erase(victim->pay);
+        buffer_used -= victim->len;
+        buffers.erase(victim);
+        existing = buffer_index.end();
     }
-    abort(insert_at == 0, UNITXT("insert_at == 0"));
 
     buffer_t b;
     b.pay = payload;
-    b.buffer_offset = insert_at;
-    memcpy(insert_at, src, len);
     b.len = len;
-    buffers.push_back(b);
+    b.data.reset(new char[len]);
+    memcpy(b.data.get(), src, len);
+    buffers.push_front(std::move(b));
+    buffer_index[payload] = buffers.begin();
+    buffer_used += len;
 }
 
+// Returns the cached bytes [payload, payload + len) or 0. The pointer is valid until the next buffer_add()
 char *buffer_find(uint64_t payload, size_t len) {
-    for (unsigned int i = 0; i < buffers.size(); i++) {
-        if (payload >= buffers[i].pay && payload + len <= buffers[i].pay + buffers[i].len) {
-            size_t off = 0;
-            if (payload > buffers[i].pay) {
-                off = payload - buffers[i].pay;
-            }
-            return buffers[i].buffer_offset + off;
-        }
+    auto it = buffer_index.upper_bound(payload);
+    if (it == buffer_index.begin()) {
+        return 0;
+    }
+    --it;
+    buffer_t &b = *it->second;
+    if (payload + len > b.pay + b.len) {
+        return 0;
+    }
+    buffers.splice(buffers.begin(), buffers, it->second);
+    return b.data.get() + (payload - b.pay);
+}
+
+// Ring buffer of the most recently restored payload, for restore from stdin where the output is written in payload
+// order. Byte p is at window[p % window_size] and the window holds [max(window_begin, window_end - window_size),
+// window_end). It is allocated on the first add so that restore from a file doesn't pay for it
+static std::unique_ptr<unsigned char[]> window;
+static size_t window_size = 0;
+static uint64_t window_begin = 0;
+static uint64_t window_end = 0;
+
+void window_init(size_t mem) {
+    window_size = mem;
+}
+
+// Makes room for [payload, payload + len) and calls put(offset into window, bytes to skip, length) for each
+// contiguous part of it that stays in the window
+template <class F> static void window_put(uint64_t payload, uint64_t len, F put) {
+    if (window_size == 0) {
+        return;
+    }
+    if (!window) {
+        window.reset(new unsigned char[window_size]);
+    }
+    if (payload != window_end) {
+        window_begin = payload;
+    }
+    window_end = payload + len;
+
+    uint64_t skip = len > window_size ? len - window_size : 0;
+    while (skip < len) {
+        size_t pos = (payload + skip) % window_size;
+        size_t n = minimum(len - skip, window_size - pos);
+        put(pos, skip, n);
+        skip += n;
+    }
+}
+
+void window_add(const unsigned char *src, uint64_t payload, size_t len) {
+    window_put(payload, len, [&](size_t pos, uint64_t skip, size_t n) { memcpy(window.get() + pos, src + skip, n); });
+}
+
+void window_fill(unsigned char value, uint64_t payload, uint64_t len) {
+    window_put(payload, len, [&](size_t pos, uint64_t, size_t n) { memset(window.get() + pos, value, n); });
+}
+
+// Copies [payload, payload + len) to dst and returns true if it's all in the window
+bool window_find(unsigned char *dst, uint64_t payload, size_t len) {
+    uint64_t first = window_end - window_begin > window_size ? window_end - window_size : window_begin;
+    if (!window || payload < first || payload + len > window_end) {
+        return false;
+    }
+    for (size_t done = 0; done < len;) {
+        size_t pos = (payload + done) % window_size;
+        size_t n = minimum(len - done, window_size - pos);
+        memcpy(dst + done, window.get() + pos, n);
+        done += n;
     }
-    return 0;
+    return true;
 }
@@ -11,3 +11,8 @@
 void buffer_add(const unsigned char *src, uint64_t payload, size_t len);
 char *buffer_find(uint64_t payload, size_t len);
 void buffer_init(size_t mem);
+
+void window_init(size_t mem);
+void window_add(const unsigned char *src, uint64_t payload, size_t len);
+void window_fill(unsigned char value, uint64_t payload, uint64_t len);
+bool window_find(unsigned char *dst, uint64_t payload, size_t len);
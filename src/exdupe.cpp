@@ -19,6 +19,9 @@
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
+#include <mutex>
 #include <random>
 #include <stdarg.h>
 #include <stdint.h>
@@ -27,6 +30,8 @@
 #include <string>
 #include <sys/stat.h>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -71,6 +76,8 @@ const bool WIN = false;
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
 #include <sstream>
 #include <string>
 
@@ -82,6 +89,8 @@ const bool WIN = false;
 #include "ui.hpp"
 #include "unicode.h"
 #include "utilities.hpp"
+#include "walker.hpp"
+#include "readahead.hpp"
 #include "timestamp.h"
 
 #ifdef _WIN32
@@ -107,12 +116,16 @@ size_t DEDUPE_LARGE = 128 * K;
 const size_t DISK_READ_CHUNK = 1 * M;
 
 // Restore takes part by resolving a tree structure of backwards references in
-// past data. Resolve RESTORE_CHUNKSIZE bytes of payload at a time (too large
-// value can potentially expand a too huge tree; too small value can be slow)
+// past data. Resolve RESTORE_BATCH bytes of payload at a time (too large
+// value can potentially expand a too huge tree; too small value gives less
+// sequential reads of the archive). Output is written RESTORE_CHUNKSIZE bytes at
+// a time, which is also the granularity of holes.
+const size_t RESTORE_BATCH = 8 * M;
 const size_t RESTORE_CHUNKSIZE = 128 * K;
 
-// Keep the last RESTORE_BUFFER bytes of resolved data in memory, so that we
-// don't have to seek on the disk while building above mentioned tree
+// Keep the most recently used RESTORE_BUFFER bytes of resolved data in memory,
+// so that we don't have to seek on the disk while building above mentioned tree.
+// Can be changed with -m or -g at restore.
 const size_t RESTORE_BUFFER = 256 * M;
 
 #define compile_assert(x) extern int __dummy[(int)x];
@@ -130,6 +143,9 @@ bool overwrite_flag = false;
 bool recursive_flag = true;
 bool restore_flag = false;
 uint32_t threads = 8;
+uint32_t readahead_mb = 16; // MB
+uint32_t open_files = 64;   // restored files kept open for references by restore from stdin
+uint32_t cache_flag = CACHE_NORMAL;
 int flags_exist = 0;
 bool diff_flag = false;
 bool compress_flag = false;
@@ -139,6 +155,12 @@ bool follow_symlinks = false;
 bool shadow_copy = false;
 bool absolute_path = false;
 bool hash_flag = false;
+bool compact_flag = false;
+bool quick_flag = false;
+uint32_t quick_verify = 0; // verify every n'th file skipped by -q
+bool incremental_flag = false;
+bool whole_flag = false;
+bool interleave_flag = true; // -n turns off interleaving of the hash table across NUMA nodes
 
 uint32_t verbose_level = 1;
 uint32_t megabyte_flag = 0;
@@ -155,12 +177,20 @@ uint64_t hash_salt;
 
 STRING full;
 STRING diff;
+vector<STRING> diffs; // chain of differential backups to restore, diff is the last
 STRING directory;
 vector<STRING> inputfiles;
 STRING name;
 vector<STRING> restorelist; // optional list of individual files/dirs to restore
-vector<STRING> excludelist;
+STRING restore_parent;      // parent_path() of restorelist
+// Items excluded with --, normalized like abs_path(). Literal paths are looked up in a hash set. Wildcard patterns are
+// grouped by their number of delimiters, since * and ? never span one and a path can only match patterns of its depth
+unordered_set<STRING> exclude_paths;
+vector<vector<STRING>> exclude_patterns;
+STRING exclude_base; // base_dir of compress() and its normalized form, so that entries are excluded without abs_path()
+STRING exclude_root;
 STRING lua = UNITXT("");
+std::mutex lua_mutex; // the Walker threads run the -f filter on the directories that they would list ahead
 vector<STRING> shadows;
 
 FILE *ofile = 0, *ifile = 0;
@@ -178,13 +208,15 @@ STRING flags;
 
 char tmp[1000000 + DISK_READ_CHUNK];
 
-unsigned char extract_concatenate[RESTORE_CHUNKSIZE + 1000000];
+unsigned char extract_concatenate[RESTORE_BATCH + 1000000];
 unsigned char *extract_in;
 unsigned char *extract_out;
 
 STRING output_file;
 bool output_file_mine = false;
 void *hashtable;
+void *overlaytable = nullptr;
+uint64_t overlay_memory = 0;
 
 STRING tempdiff = UNITXT("EXDUPE.TMP");
 
@@ -192,9 +224,11 @@ typedef struct {
     STRING filename;
     uint64_t offset;
     FILE *handle;
+    std::list<size_t>::iterator lru; // position in open_infiles if handle is set
 } file_offset_t;
 
 vector<file_offset_t> infiles;
+std::list<size_t> open_infiles; // indexes into infiles with an open handle, most recently used first
 
 typedef struct {
     STRING name;
@@ -224,6 +258,23 @@ typedef struct {
 vector<reference_t> references;
 vector<reference_t> read_ahead;
 
+// The REFERENC section is stored in blocks of REF_BLOCK references that restore decodes only when it needs them, located
+// by a sparse index of their first payloads. At most REF_CACHE decoded blocks are kept
+const size_t REF_BLOCK = 4096;
+const size_t REF_CACHE = 256;
+
+typedef struct {
+    uint64_t payload; // of first reference
+    uint64_t end;     // payload after last reference
+    uint64_t offset;  // in file
+    FILE *file;
+    uint32_t count;
+    uint32_t raw;
+    uint32_t packed;
+} ref_block_t;
+
+vector<ref_block_t> ref_index;
+
 uint64_t total_decompressed = 0;
 
 void move_cursor_up() {
@@ -261,8 +312,10 @@ void abort(bool b, const CHR *fmt, ...) {
 
 #define DIFFERENTIAL_BACKUP                                                                                                                                    \
     UNITXT("Differential backup:\n")                                                                                                                           \
-    UNITXT("   -D[vxarctpl] [-f] [-s] <sources> <.full file> <destination>\n")                                                                                 \
-    UNITXT("   -D[vxarctpl] <-stdin> <filename to assign> <.full file> "                                                                                       \
+    UNITXT("   -D[vxarctpmglq] [-f] [-s] <sources> <.full file> <destination>\n")                                                                              \
+    UNITXT("   -DI[vxarctplq] [-f] [-s] <sources> <.full file | last .diff file of chain> "                                                                    \
+           "<destination>\n")                                                                                                                                  \
+    UNITXT("   -D[vxarctpmglI] <-stdin> <filename to assign> <.full file> "                                                                                    \
            "<destination>\n\n")                                                                                                                                \
     UNITXT("   <destination> can either be -stdout or a file. Use .diff as "                                                                                   \
            "file extension")
@@ -277,11 +330,14 @@ void abort(bool b, const CHR *fmt, ...) {
 
 #define RESTORE_DIFFERENTIAL_BACKUP                                                                                                                            \
     UNITXT("Restore differential backup:\n")                                                                                                                   \
-    UNITXT("   -RD[vo] <.full> <.diff file> <destination directory | "                                                                                         \
+    UNITXT("   -RD[vo] <.full> <.diff files> <destination directory | "                                                                                        \
            "-stdout> [files]\n\n")                                                                                                                             \
-    UNITXT("   [files] is one or more files, drives or directories to "                                                                                        \
-           "restore, typed as\n")                                                                                                                              \
-    UNITXT("   printed by the -L flag")
+    UNITXT("   <.diff files> is the .diff file to restore, preceded by the "                                                                                   \
+           "incremental backups\n")                                                                                                                            \
+    UNITXT("   it is based on, in the order they were made. [files] is one "                                                                                   \
+           "or more files,\n")                                                                                                                                 \
+    UNITXT("   drives or directories to restore, typed as printed by the -L "                                                                                  \
+           "flag")
 
 #define OTHER                                                                                                                                                  \
     UNITXT("List contents: -L <.full file | .diff file>\n\n")                                                                                                  \
@@ -325,6 +381,9 @@ void add_file(const STRING &file, uint64_t offset) {
 //
 // **************************************************************************************************************
 
+// A differential backup continues the payload of the .full, and of the diffs before it when incremental, so that its
+// references can point into any of them. Its own payloads are stored relative to where it starts
+uint64_t chain_payload = 0;
 uint64_t pay_count = 0;
 
 // todo, change to STL lower_bound
@@ -375,6 +434,10 @@ void add_references(const unsigned char *src, size_t len, uint64_t archive_offse
             // reference
             ref.payload_reference = payload;
             ref.archive_offset = 0;
+        } else if (r == 2) {
+            // run of identical bytes, value is kept in payload_reference
+            ref.payload_reference = payload;
+            ref.archive_offset = 0;
         } else {
             abort(true, UNITXT("Internal error, dup_decompress_simulate() = %d"), r);
         }
@@ -383,155 +446,445 @@ void add_references(const unsigned char *src, size_t len, uint64_t archive_offse
     }
 }
 
-int write_references(FILE *file) {
-    io.try_write("REFERENC", 8, file);
-    uint64_t w = io.write_count;
-    io.write_ui<uint64_t>(references.size(), file);
+// The archive ends with a fixed size directory of its meta data sections so that a reader can locate any of them with a
+// single read of the last FOOTER_SIZE bytes: FOOTER_SLOTS entries of name, offset, size and checksum of the data that
+// follows the name, followed by "END". Unused entries are zero
+const size_t FOOTER_SLOTS = 8;
+const size_t FOOTER_SIZE = FOOTER_SLOTS * (8 + 8 + 8 + 8) + 3;
 
-    for (size_t i = 0; i < references.size(); i++) {
-        io.write_ui<uint8_t>(references[i].is_reference, file);
-        if (references[i].is_reference) {
-            io.write_ui<uint64_t>(references[i].payload_reference, file);
-        } else {
-            io.write_ui<uint64_t>(references[i].archive_offset, file);
+typedef struct {
+    string name;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+    bool verified = false; // when reading, set by the first seek_to_header()
+} section_t;
+
+vector<section_t> sections;
+checksum_t section_checksum;
+
+void begin_section(const string &name, FILE *file) {
+    io.try_write(name.c_str(), 8, file);
+    sections.push_back({name, io.write_count, 0, 0});
+    checksum_init(&section_checksum);
+    io.write_checksum = &section_checksum;
+}
+
+// Each section also ends with its size, which is not part of the section
+void end_section(FILE *file) {
+    io.write_checksum = nullptr;
+    sections.back().size = io.write_count - sections.back().offset;
+    sections.back().checksum = section_checksum.result;
+    io.write_ui<uint64_t>(sections.back().size, file);
+}
+
+void write_footer(FILE *file) {
+    abort(sections.size() > FOOTER_SLOTS, UNITXT("Internal error, too many sections"));
+    for (size_t i = 0; i < FOOTER_SLOTS; i++) {
+        section_t e = i < sections.size() ? sections[i] : section_t{"", 0, 0, 0};
+        char name[8] = {0};
+        memcpy(name, e.name.c_str(), e.name.size());
+        io.try_write(name, 8, file);
+        io.write_ui<uint64_t>(e.offset, file);
+        io.write_ui<uint64_t>(e.size, file);
+        io.write_ui<uint64_t>(e.checksum, file);
+    }
+    io.try_write("END", 3, file);
+}
+
+// Footers of the archives being read, parsed at their first lookup
+std::map<FILE *, vector<section_t>> footers;
+
+section_t *locate_section(FILE *file, const string &name, bool required) {
+    auto it = footers.find(file);
+    if (it == footers.end()) {
+        unsigned char footer[FOOTER_SIZE];
+        uint64_t orig = io.tell(file);
+        abort(io.seek(file, -static_cast<int64_t>(FOOTER_SIZE), SEEK_END) != 0, UNITXT("Archive corrupted or on a non-seekable device"));
+        io.try_read(footer, FOOTER_SIZE, file);
+        io.seek(file, orig, SEEK_SET);
+        abort(!equal2(footer + FOOTER_SIZE - 3, "END", 3), UNITXT("Unexpected end of archive (header end marker)"));
+
+        auto u64 = [&](const unsigned char *src) {
+            uint64_t v = 0;
+            for (int i = 7; i >= 0; i--) {
+                v = (v << 8) | src[i];
+            }
+            return v;
+        };
+
+        it = footers.emplace(file, vector<section_t>()).first;
+        for (size_t i = 0; i < FOOTER_SLOTS; i++) {
+            const unsigned char *e = footer + i * 32;
+            if (e[0] != 0) {
+                it->second.push_back({string(reinterpret_cast<const char *>(e), strnlen(reinterpret_cast<const char *>(e), 8)), u64(e + 8), u64(e + 16), u64(e + 24)});
+            }
         }
+    }
 
-        io.write_ui<uint64_t>(references[i].payload, file);
-        io.write_ui<uint32_t>(static_cast<uint32_t>(references[i].length), file);
+    for (auto &e : it->second) {
+        if (e.name == name) {
+            return &e;
+        }
+    }
+    abort(required, UNITXT("Cannot find header '%s'"), name.c_str());
+    return nullptr;
+}
+
+section_t find_section(FILE *file, const string &name, bool required = true) {
+    section_t *e = locate_section(file, name, required);
+    return e ? *e : section_t{"", 0, 0, 0};
+}
+
+// Writes a zstd compressed block of meta data and returns its size in the archive
+uint32_t write_packed(const vector<unsigned char> &raw, FILE *file) {
+    vector<unsigned char> packed(dup_pack_bound(raw.size()));
+    size_t p = dup_pack(raw.data(), raw.size(), packed.data(), packed.size(), 3);
+    abort(p == 0, UNITXT("Internal error, dup_pack()"));
+    io.try_write(packed.data(), p, file);
+    return static_cast<uint32_t>(p);
+}
+
+// Reads a block written by write_packed() at offset without moving the file position
+void read_packed(FILE *file, uint64_t offset, size_t packed, size_t raw, vector<unsigned char> &dst) {
+    vector<unsigned char> src(packed);
+    dst.resize(raw);
+    uint64_t orig = io.tell(file);
+    io.seek(file, offset, SEEK_SET);
+    io.try_read(src.data(), packed, file);
+    io.seek(file, orig, SEEK_SET);
+    abort(dup_unpack(src.data(), packed, dst.data(), raw) != raw, UNITXT("Archive corrupted (meta data block)"));
+}
+
+// Block layout, before zstd: is_reference of each reference, then lengths, then one varint per reference that is the
+// archive offset of a literal as delta to the previous literal, the zigzag'ed distance back to the payload of a
+// reference, or the byte value of a run. Payloads need no storing because they are contiguous
+void encode_reference_block(const reference_t *refs, size_t n, vector<unsigned char> &dst) {
+    uint64_t last_offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        dst.push_back(static_cast<unsigned char>(refs[i].is_reference));
+    }
+    for (size_t i = 0; i < n; i++) {
+        put_varint(dst, refs[i].length);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (refs[i].is_reference == 0) {
+            put_varint(dst, refs[i].archive_offset - last_offset);
+            last_offset = refs[i].archive_offset;
+        } else if (refs[i].is_reference == 1) {
+            uint64_t d = refs[i].payload - refs[i].payload_reference;
+            put_varint(dst, (d << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(d) >> 63));
+        } else {
+            put_varint(dst, refs[i].payload_reference);
+        }
     }
+}
+
+int write_references(FILE *file) {
+    begin_section("REFERENC", file);
+    uint64_t w = io.write_count;
+    vector<ref_block_t> index;
+    vector<unsigned char> raw;
+
+    for (size_t b = 0; b < references.size(); b += REF_BLOCK) {
+        ref_block_t block;
+        block.count = static_cast<uint32_t>(minimum(references.size() - b, REF_BLOCK));
+        block.payload = references[b].payload - chain_payload;
+        block.offset = io.write_count - w;
+
+        raw.clear();
+        encode_reference_block(&references[b], block.count, raw);
+        block.raw = static_cast<uint32_t>(raw.size());
+        block.packed = write_packed(raw, file);
+        index.push_back(block);
+    }
+
+    uint64_t index_offset = io.write_count - w;
+    io.write_ui<uint64_t>(index.size(), file);
+    for (auto &block : index) {
+        io.write_ui<uint64_t>(block.payload, file);
+        io.write_ui<uint64_t>(block.offset, file);
+        io.write_ui<uint32_t>(block.count, file);
+        io.write_ui<uint32_t>(block.raw, file);
+        io.write_ui<uint32_t>(block.packed, file);
+    }
+    io.write_ui<uint64_t>(references.empty() ? 0 : references.back().payload + references.back().length - chain_payload, file);
+    io.write_ui<uint64_t>(index_offset, file);
 
     io.write_ui<uint32_t>(0, file);
-    io.write_ui<uint64_t>(io.write_count - w, file);
+    end_section(file);
 
     return 0;
 }
 
-uint64_t seek_to_header(FILE *file, const string &header) {
-    //  archive   HEADER  data  sizeofdata  HEADER  data  sizeofdata
+// A differential backup records the payload that it starts at, so that restore can tell if the archives of a chain are
+// complete and in order
+void write_diff_base(FILE *file) {
+    begin_section("DIFFBASE", file);
+    io.write_ui<uint64_t>(chain_payload, file);
+    end_section(file);
+}
+
+// Seeks to the data of a section and returns the original position. The section is checked against the checksum in the
+// footer the first time, unless the caller checks it while reading, like read_hashtable() does
+uint64_t seek_to_header(FILE *file, const string &header, uint64_t *size = 0, bool verify = true) {
     uint64_t orig = io.tell(file);
-    uint64_t s;
-    string h = "";
-    int i = io.seek(file, -3, SEEK_END);
-    abort(i != 0, UNITXT("Archive corrupted or on a non-seekable device"));
-    io.try_read(tmp, 3, file);
-    abort(!equal2(tmp, "END", 3), UNITXT("Unexpected end of archive (header end marker)"));
-    io.seek(file, -3, SEEK_END);
-
-    while (h != header) {
-        abort(io.seek(file, -8, SEEK_CUR) != 0, UNITXT("Cannot find header '%s'"), header.c_str());
-        s = io.read_ui<uint64_t>(file);
-        abort(io.seek(file, -8 - s - 8, SEEK_CUR) != 0, UNITXT("Cannot find header '%s'"), header.c_str());
-        memset(tmp, 0, 9);
-        io.try_read(tmp, 8, file);
-        h = tmp;
-        abort(io.seek(file, -8, SEEK_CUR) != 0, UNITXT("Cannot find header '%s'"), header.c_str());
-    }
-    io.seek(file, 8, SEEK_CUR);
+    section_t *e = locate_section(file, header, true);
+    if (verify && !e->verified) {
+        checksum_t t;
+        checksum_init(&t);
+        vector<unsigned char> buf(minimum(e->size, DISK_READ_CHUNK));
+        io.seek(file, e->offset, SEEK_SET);
+        for (uint64_t done = 0; done < e->size;) {
+            size_t n = static_cast<size_t>(minimum(e->size - done, buf.size()));
+            io.try_read(buf.data(), n, file);
+            checksum(buf.data(), n, &t);
+            done += n;
+        }
+        abort(t.result != e->checksum, UNITXT("Archive corrupted (%s checksum)"), header.c_str());
+        e->verified = true;
+    }
+    io.seek(file, e->offset, SEEK_SET);
+    if (size) {
+        *size = e->size;
+    }
     return orig;
 }
 
+// Returns the size of the payload of an archive, and leaves the file at the reference index
+uint64_t read_reference_total(FILE *file, uint64_t *section, uint64_t *index_offset) {
+    uint64_t size;
+    seek_to_header(file, "REFERENC", &size);
+    *section = io.tell(file);
+
+    io.seek(file, *section + size - 4 - 8 - 8, SEEK_SET);
+    uint64_t total = io.read_ui<uint64_t>(file);
+    *index_offset = io.read_ui<uint64_t>(file);
+    abort(*index_offset > size, UNITXT("Archive corrupted (reference index)"));
+    io.seek(file, *section + *index_offset, SEEK_SET);
+    return total;
+}
+
+uint64_t archive_payload(FILE *file) {
+    uint64_t orig = io.tell(file);
+    uint64_t section, index_offset;
+    uint64_t total = read_reference_total(file, &section, &index_offset);
+    io.seek(file, orig, SEEK_SET);
+    return total;
+}
+
+// Reads the block index of the REFERENC section only. Payloads of the archive are offset by base_payload
 uint64_t read_references(FILE *file, uint64_t base_payload) {
-    uint64_t orig = seek_to_header(file, "REFERENC");
-    uint64_t n = io.read_ui<uint64_t>(file);
-    uint64_t added_payload = 0;
+    uint64_t orig = io.tell(file);
+    uint64_t section, index_offset;
+    uint64_t total = read_reference_total(file, &section, &index_offset);
 
+    uint64_t n = io.read_ui<uint64_t>(file);
     for (uint64_t i = 0; i < n; i++) {
-        reference_t ref;
-
-        ref.is_reference = io.read_ui<uint8_t>(file);
-        if (ref.is_reference) {
-            ref.payload_reference = io.read_ui<uint64_t>(file);
-        } else {
-            ref.archive_offset = io.read_ui<uint64_t>(file);
+        ref_block_t block;
+        block.payload = io.read_ui<uint64_t>(file) + base_payload;
+        block.offset = io.read_ui<uint64_t>(file) + section;
+        block.count = io.read_ui<uint32_t>(file);
+        block.raw = io.read_ui<uint32_t>(file);
+        block.packed = io.read_ui<uint32_t>(file);
+        block.file = file;
+        block.end = base_payload + total;
+        if (i > 0) {
+            ref_index.back().end = block.payload;
         }
-        ref.payload = io.read_ui<uint64_t>(file) + base_payload;
-        ref.length = io.read_ui<uint32_t>(file);
-
-        added_payload += ref.length;
-        references.push_back(ref);
+        ref_index.push_back(block);
     }
 
     io.seek(file, orig, SEEK_SET);
-    return added_payload;
+    return total;
 }
 
-uint64_t find_reference(uint64_t payload) {
-    uint64_t lower = 0;
-    uint64_t upper = references.size() - 1;
-
-    if (references.size() == 0) {
-        return std::numeric_limits<uint64_t>::max();
-    }
-
-    while (upper != lower) {
-        uint64_t middle = lower + (upper - lower) / 2;
+uint64_t read_diff_base(FILE *file) {
+    uint64_t orig = seek_to_header(file, "DIFFBASE");
+    uint64_t base = io.read_ui<uint64_t>(file);
+    io.seek(file, orig, SEEK_SET);
+    return base;
+}
 
-        if (references[middle].payload + references[middle].length - 1 < payload) {
-            lower = middle + 1;
+vector<reference_t> &load_reference_block(size_t b) {
+    static std::list<std::pair<size_t, vector<reference_t>>> cache;
+    static std::map<size_t, decltype(cache)::iterator> cached;
+
+    auto it = cached.find(b);
+    if (it != cached.end()) {
+        cache.splice(cache.begin(), cache, it->second);
+        return it->second->second;
+    }
+
+    if (cache.size() >= REF_CACHE) {
+        cached.erase(cache.back().first);
+        cache.pop_back();
+    }
+
+    const ref_block_t &block = ref_index[b];
+    vector<unsigned char> raw;
+    read_packed(block.file, block.offset, block.packed, block.raw, raw);
+
+    cache.emplace_front(b, vector<reference_t>(block.count));
+    cached[b] = cache.begin();
+    vector<reference_t> &refs = cache.front().second;
+
+    const unsigned char *src = raw.data() + block.count;
+    const unsigned char *end = raw.data() + raw.size();
+    uint64_t payload = block.payload;
+    uint64_t last_offset = 0;
+    bool ok = raw.size() >= block.count;
+    for (size_t i = 0; ok && i < block.count; i++) {
+        uint64_t len;
+        ok = get_varint(src, end, len);
+        refs[i].is_reference = static_cast<char>(raw[i]);
+        refs[i].length = len;
+        refs[i].payload = payload;
+        refs[i].archive_offset = 0;
+        refs[i].payload_reference = 0;
+        payload += len;
+    }
+    for (size_t i = 0; ok && i < block.count; i++) {
+        uint64_t v;
+        ok = get_varint(src, end, v);
+        if (refs[i].is_reference == 0) {
+            last_offset += v;
+            refs[i].archive_offset = last_offset;
+        } else if (refs[i].is_reference == 1) {
+            refs[i].payload_reference = refs[i].payload - ((v >> 1) ^ (0 - (v & 1)));
         } else {
-            upper = middle;
+            refs[i].payload_reference = v;
         }
     }
+    abort(!ok || payload != block.end, UNITXT("Archive corrupted (reference block)"));
+    return refs;
+}
 
-    if (references[lower].payload <= payload && references[lower].payload + references[lower].length - 1 >= payload) {
-        return lower;
-    } else {
-        return std::numeric_limits<uint64_t>::max();
+// Finds the reference that contains payload and returns the block it is in, or nullptr
+const ref_block_t *find_reference(uint64_t payload, reference_t &ref) {
+    auto b = std::upper_bound(ref_index.begin(), ref_index.end(), payload, [](uint64_t p, const ref_block_t &block) { return p < block.payload; });
+    if (b == ref_index.begin() || payload >= (b - 1)->end) {
+        return nullptr;
     }
+
+    vector<reference_t> &refs = load_reference_block(b - 1 - ref_index.begin());
+    auto r = std::upper_bound(refs.begin(), refs.end(), payload, [](uint64_t p, const reference_t &x) { return p < x.payload; });
+    ref = *(r - 1);
+    return &*(b - 1);
 }
 
-bool resolve(uint64_t payload, size_t size, unsigned char *dst, FILE *ifile, FILE *fdiff, uint64_t splitpay) {
+// A piece of a literal packet that must be copied to dst + dst_offset
+typedef struct {
+    reference_t ref;
+    FILE *file; // archive that the packet is in
+    uint64_t prior;
+    size_t len;
+    size_t dst_offset;
+} literal_need_t;
+
+// Expands the tree of references of [payload, payload + size) into the pieces of literal packets it consists of. Fill
+// and literals that are still in the restore buffer are written to dst at once. data[i] is set for each
+// RESTORE_CHUNKSIZE of dst that is not entirely zero fill
+void plan_resolve(uint64_t payload, size_t size, unsigned char *dst, size_t dst_offset, vector<literal_need_t> &needs, vector<char> &data) {
     size_t bytes_resolved = 0;
 
+    auto mark_data = [&](size_t offset, size_t len) {
+        for (size_t i = offset / RESTORE_CHUNKSIZE; i <= (offset + len - 1) / RESTORE_CHUNKSIZE; i++) {
+            data[i] = 1;
+        }
+    };
+
     while (bytes_resolved < size) {
-        uint64_t rr = find_reference(payload + bytes_resolved);
-        if (rr == std::numeric_limits<uint64_t>::max()) {
+        reference_t ref;
+        const ref_block_t *block = find_reference(payload + bytes_resolved, ref);
+        if (!block) {
             abort(true, UNITXT("Internal error, find_reference() = -1"));
         }
-        uint64_t prior = payload + bytes_resolved - references[rr].payload;
+        uint64_t prior = payload + bytes_resolved - ref.payload;
         size_t needed = size - bytes_resolved;
-        size_t ref_has = references[rr].length - prior >= needed ? needed : references[rr].length - prior;
-
-        if (references[rr].is_reference) {
-            resolve(references[rr].payload_reference + prior, ref_has, dst + bytes_resolved, ifile, fdiff, splitpay);
+        size_t ref_has = ref.length - prior >= needed ? needed : ref.length - prior;
+        size_t at = dst_offset + bytes_resolved;
+
+        if (ref.is_reference == 1) {
+            plan_resolve(ref.payload_reference + prior, ref_has, dst, at, needs, data);
+        } else if (ref.is_reference == 2) {
+            memset(dst + at, static_cast<int>(ref.payload_reference), ref_has);
+            if (ref.payload_reference != 0) {
+                mark_data(at, ref_has);
+            }
         } else {
-
-            char *b = buffer_find(references[rr].payload, references[rr].length);
+            mark_data(at, ref_has);
+            char *b = buffer_find(ref.payload, ref.length);
             if (b != 0) {
-                memcpy(dst + bytes_resolved, b + prior, ref_has);
+                memcpy(dst + at, b + prior, ref_has);
             } else {
-                FILE *f;
-                if (references[rr].payload >= splitpay) {
-                    f = fdiff;
-                } else {
-                    f = ifile;
-                }
+                needs.push_back({ref, block->file, prior, ref_has, at});
+            }
+        }
+        bytes_resolved += ref_has;
+    }
+}
 
-                // seek and read and decompress raw data
-                uint64_t orig = io.tell(f);
-                uint64_t ao = references[rr].archive_offset;
-                io.seek(f, ao, SEEK_SET);
-                io.try_read(extract_in, (32 - 6 - 8), f);
-                size_t len = dup_size_compressed(extract_in);
-                io.try_read(extract_in + (32 - 6 - 8), len - (32 - 6 - 8), f);
-                uint64_t p;
-                int r = dup_decompress(extract_in, extract_out, &len, &p);
-                total_decompressed += len;
-
-                if (r != 0 && r != 1) {
-                    abort(true, UNITXT("Internal error, dup_decompress() = %d"), r);
-                }
+// Restores [payload, payload + size) into dst. Rather than reading each literal packet as the walk of the reference
+// tree reaches it, the packets are collected first and then read in one sweep sorted by archive offset, so that
+// heavily deduplicated data doesn't turn into random reads of the archive. holes[i] is set if the i'th
+// RESTORE_CHUNKSIZE of dst is entirely zero fill, which the caller can write as a hole
+void resolve(uint64_t payload, size_t size, unsigned char *dst, vector<char> &holes) {
+    vector<literal_need_t> needs;
+    vector<char> data((size + RESTORE_CHUNKSIZE - 1) / RESTORE_CHUNKSIZE, 0);
+    plan_resolve(payload, size, dst, 0, needs, data);
 
-                buffer_add(extract_out, references[rr].payload, references[rr].length);
+    holes.resize(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        holes[i] = !data[i];
+    }
 
-                io.seek(f, orig, SEEK_SET);
-                memcpy(dst + bytes_resolved, extract_out + prior, ref_has);
-            }
+    // Payload order is archive order, and the archives of a chain follow each other in payload
+    std::sort(needs.begin(), needs.end(), [](const literal_need_t &a, const literal_need_t &b) {
+        return std::make_pair(a.ref.payload, a.dst_offset) < std::make_pair(b.ref.payload, b.dst_offset);
+    });
+
+    vector<pair<FILE *, uint64_t>> orig;
+    FILE *at_file = 0;
+    uint64_t at_offset = 0;
+
+    for (size_t i = 0; i < needs.size();) {
+        const reference_t ref = needs[i].ref;
+        FILE *f = needs[i].file;
+        uint64_t ao = ref.archive_offset;
+
+        if (f != at_file && std::find_if(orig.begin(), orig.end(), [&](const pair<FILE *, uint64_t> &o) { return o.first == f; }) == orig.end()) {
+            orig.push_back({f, io.tell(f)});
+        }
+
+        // Consecutive packets are read without seeking
+        if (f != at_file || ao != at_offset) {
+            io.seek(f, ao, SEEK_SET);
+        }
+        io.try_read(extract_in, (32 - 6 - 8), f);
+        size_t len = dup_size_compressed(extract_in);
+        io.try_read(extract_in + (32 - 6 - 8), len - (32 - 6 - 8), f);
+        at_file = f;
+        at_offset = ao + len;
+
+        uint64_t p;
+        int r = dup_decompress(extract_in, extract_out, &len, &p);
+        total_decompressed += len;
+
+        if (r != 0 && r != 1) {
+            abort(true, UNITXT("Internal error, dup_decompress() = %d"), r);
+        }
+
+        buffer_add(extract_out, ref.payload, ref.length);
+
+        for (; i < needs.size() && needs[i].ref.payload == ref.payload; i++) {
+            memcpy(dst + needs[i].dst_offset, extract_out + needs[i].prior, needs[i].len);
         }
-        bytes_resolved += ref_has;
     }
 
-    return false;
+    for (auto &o : orig) {
+        io.seek(o.first, o.second, SEEK_SET);
+    }
 }
 
 void print_file(STRING filename, uint64_t size, tm *file_date = 0, int attributes = 0) {
@@ -546,11 +899,9 @@ void print_file(STRING filename, uint64_t size, tm *file_date = 0, int attribute
 #endif
 }
 
-bool save_directory(STRING base_dir, STRING path, bool write = false) {
-    static STRING last_full = UNITXT("");
-    static bool first_time = true;
-
-    STRING full = base_dir + path;
+// Returns the name that save_directory() stores for a directory, and sets full to its path on disk
+STRING directory_name(const STRING &base_dir, STRING path, STRING &full) {
+    full = base_dir + path;
     full = remove_delimitor(full) + DELIM_STR;
     STRING full_orig = full;
 
@@ -570,17 +921,21 @@ bool save_directory(STRING base_dir, STRING path, bool write = false) {
         }
     }
 #endif
+    return absolute_path ? full : path;
+}
+
+bool save_directory(STRING base_dir, STRING path, bool write = false) {
+    static STRING last_full = UNITXT("");
+    static bool first_time = true;
+
+    STRING full;
+    STRING name = directory_name(base_dir, path, full);
+
     if (full != last_full || first_time) {
         contents_t c;
         c.directory = true;
         c.symlink = false;
-
-        if (absolute_path) {
-            c.name = full;
-        } else {
-            c.name = path;
-        }
-
+        c.name = name;
         c.link = UNITXT("");
         c.payload = 0;
         c.checksum = 0;
@@ -601,10 +956,10 @@ bool save_directory(STRING base_dir, STRING path, bool write = false) {
 
 int write_hashtable(FILE *file) {
     size_t t = dup_compress_hashtable();
-    io.try_write("HASHTBLE", 8, file);
+    begin_section("HASHTBLE", file);
     io.write_ui<uint64_t>(t, file);
     io.try_write(hashtable, t, file);
-    io.write_ui<uint64_t>(t + 8, file);
+    end_section(file);
 #ifdef _DEBUG
     dup_decompress_hashtable(t);
 #endif
@@ -612,31 +967,210 @@ int write_hashtable(FILE *file) {
 }
 
 uint64_t read_hashtable(FILE *file) {
-    uint64_t orig = seek_to_header(file, "HASHTBLE");
+    uint64_t size;
+    uint64_t orig = seek_to_header(file, "HASHTBLE", &size, false);
     uint64_t s = io.read_ui<uint64_t>(file);
+    abort(s + 8 != size, UNITXT("'%s' is corrupted or not a .full file (hash table)"), slashify(full).c_str());
     if (verbose_level > 0) {
         statusbar.clear_line();
         statusbar.print(1, UNITXT("Reading %s MB of meta data from .full file...\r"), s2w(format_size(s)).c_str());
     }
     io.try_read(hashtable, s, file);
     io.seek(file, orig, SEEK_SET);
+
+    // Verified before decompression, which works on the table in place
+    checksum_t t;
+    unsigned char len[8];
+    for (int i = 0; i < 8; i++) {
+        len[i] = static_cast<unsigned char>(s >> (8 * i));
+    }
+    checksum_init(&t);
+    checksum(len, 8, &t);
+    checksum(static_cast<unsigned char *>(hashtable), s, &t);
+    abort(t.result != find_section(file, "HASHTBLE").checksum, UNITXT("'%s' is corrupted (hash table checksum)"), slashify(full).c_str());
+
     int i = dup_decompress_hashtable(s);
     abort(i != 0, UNITXT("'%s' is corrupted or not a .full file (hash table)"), slashify(full).c_str());
     return 0;
 }
 
+// The PATHINDX section maps paths to the CONTENTS items that restore of a [files] list needs, so that it doesn't read
+// all of CONTENTS. Keys are paths with '/' delimiters and ASCII lower case so that a lookup finds candidates for both
+// case sensitive and insensitive matching, which extract_to() then decides on. Entries are sorted by key and front
+// coded in zstd'ed blocks of PATH_BLOCK, located by a sparse index of their first keys
+const size_t PATH_BLOCK = 1024;
+
+typedef struct {
+    string key;
+    uint64_t offset;     // of the item in CONTENTS
+    uint64_t dir_offset; // of the directory item that the item is in
+} path_entry_t;
+
+typedef struct {
+    string first;
+    uint64_t offset;
+    uint32_t count;
+    uint32_t raw;
+    uint32_t packed;
+} path_block_t;
+
+vector<path_entry_t> path_entries;
+
+string path_key(const STRING &path) {
+    string k = to_utf8(path);
+    for (auto &ch : k) {
+        if (ch == '\\') {
+            ch = '/';
+        } else if (ch >= 'A' && ch <= 'Z') {
+            ch = static_cast<char>(ch - 'A' + 'a');
+        }
+    }
+    return k;
+}
+
 int write_contents(FILE *file) {
-    io.try_write("CONTENTS", 8, file);
+    begin_section("CONTENTS", file);
     uint64_t w = io.write_count;
+    STRING curdir;
+    uint64_t dir_offset = 0;
     io.write_ui<uint64_t>(contents.size(), file);
     for (size_t i = 0; i < contents.size(); i++) {
+        uint64_t offset = io.write_count - w;
+        // Same directory tracking as decompress_individuals()
+        if (contents[i].directory) {
+            curdir = remove_delimitor(contents[i].name);
+            dir_offset = offset;
+            path_entries.push_back({path_key(curdir), offset, offset});
+        } else {
+            path_entries.push_back({path_key(curdir == UNITXT("") ? contents[i].name : curdir + DELIM_STR + contents[i].name), offset, dir_offset});
+        }
         write_contents_item(file, &contents[i]);
     }
     io.write_ui<uint32_t>(0, file);
-    io.write_ui<uint64_t>(io.write_count - w, file);
+    end_section(file);
+    return 0;
+}
+
+int write_path_index(FILE *file) {
+    begin_section("PATHINDX", file);
+    uint64_t w = io.write_count;
+    vector<path_block_t> index;
+    vector<unsigned char> raw;
+
+    std::sort(path_entries.begin(), path_entries.end(), [](const path_entry_t &a, const path_entry_t &b) { return a.key < b.key; });
+
+    for (size_t b = 0; b < path_entries.size(); b += PATH_BLOCK) {
+        path_block_t block;
+        block.count = static_cast<uint32_t>(minimum(path_entries.size() - b, PATH_BLOCK));
+        block.first = path_entries[b].key;
+        block.offset = io.write_count - w;
+
+        raw.clear();
+        string prev;
+        for (size_t i = b; i < b + block.count; i++) {
+            const path_entry_t &e = path_entries[i];
+            size_t shared = 0;
+            while (shared < prev.size() && shared < e.key.size() && prev[shared] == e.key[shared]) {
+                shared++;
+            }
+            put_varint(raw, shared);
+            put_varint(raw, e.key.size() - shared);
+            raw.insert(raw.end(), e.key.begin() + shared, e.key.end());
+            put_varint(raw, e.offset);
+            put_varint(raw, e.offset - e.dir_offset);
+            prev = e.key;
+        }
+        block.raw = static_cast<uint32_t>(raw.size());
+        block.packed = write_packed(raw, file);
+        index.push_back(block);
+    }
+
+    uint64_t index_offset = io.write_count - w;
+    io.write_ui<uint64_t>(index.size(), file);
+    for (auto &block : index) {
+        io.write_ui<uint16_t>(static_cast<uint16_t>(block.first.size()), file);
+        io.try_write(block.first.data(), block.first.size(), file);
+        io.write_ui<uint64_t>(block.offset, file);
+        io.write_ui<uint32_t>(block.count, file);
+        io.write_ui<uint32_t>(block.raw, file);
+        io.write_ui<uint32_t>(block.packed, file);
+    }
+    io.write_ui<uint64_t>(index_offset, file);
+
+    io.write_ui<uint32_t>(0, file);
+    end_section(file);
     return 0;
 }
 
+// Finds the CONTENTS offsets of the items that may be restored for paths, and of the directory items they are in,
+// sorted in archive order. Returns false if a path has no candidates so that the caller can fall back to a full scan
+// and report it
+bool lookup_paths(FILE *file, const vector<STRING> &paths, vector<uint64_t> &offsets) {
+    uint64_t size;
+    uint64_t orig = seek_to_header(file, "PATHINDX", &size);
+    uint64_t section = io.tell(file);
+
+    io.seek(file, section + size - 4 - 8, SEEK_SET);
+    uint64_t index_offset = io.read_ui<uint64_t>(file);
+    abort(index_offset > size, UNITXT("Archive corrupted (path index)"));
+    io.seek(file, section + index_offset, SEEK_SET);
+
+    vector<path_block_t> index(io.read_ui<uint64_t>(file));
+    for (auto &block : index) {
+        block.first.resize(io.read_ui<uint16_t>(file));
+        io.try_read(block.first.data(), block.first.size(), file);
+        block.offset = io.read_ui<uint64_t>(file) + section;
+        block.count = io.read_ui<uint32_t>(file);
+        block.raw = io.read_ui<uint32_t>(file);
+        block.packed = io.read_ui<uint32_t>(file);
+    }
+    io.seek(file, orig, SEEK_SET);
+
+    // Adds the entries with keys in [lo, hi) and returns if there were any
+    auto range = [&](const string &lo, const string &hi) {
+        auto b = std::upper_bound(index.begin(), index.end(), lo, [](const string &k, const path_block_t &block) { return k < block.first; });
+        size_t found = 0;
+        for (b = b == index.begin() ? b : b - 1; b != index.end() && b->first < hi; b++) {
+            vector<unsigned char> raw;
+            read_packed(file, b->offset, b->packed, b->raw, raw);
+            const unsigned char *src = raw.data();
+            const unsigned char *end = raw.data() + raw.size();
+            string key;
+            for (uint32_t i = 0; i < b->count; i++) {
+                uint64_t shared, len, offset, dir;
+                bool ok = get_varint(src, end, shared) && get_varint(src, end, len) && shared <= key.size() && len <= uint64_t(end - src);
+                abort(!ok, UNITXT("Archive corrupted (path index)"));
+                key = key.substr(0, shared) + string(reinterpret_cast<const char *>(src), len);
+                src += len;
+                ok = get_varint(src, end, offset) && get_varint(src, end, dir);
+                abort(!ok, UNITXT("Archive corrupted (path index)"));
+                if (key >= lo && key < hi) {
+                    offsets.push_back(offset);
+                    if (offset - dir != 0) {
+                        offsets.push_back(offset - dir);
+                    }
+                    found++;
+                }
+            }
+        }
+        return found > 0;
+    };
+
+    bool all = true;
+    for (auto &p : paths) {
+        // A directory is followed by its contents in key order, but other names that have it as prefix can sort in
+        // between because they continue with characters before '/'
+        string k = path_key(p);
+        bool self = range(k, k + '\0');
+        bool children = range(k + '/', k + char('/' + 1));
+        all = all && (self || children);
+    }
+
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    return all;
+}
+
 STRING validchars(STRING filename) {
 #ifdef WINDOWS
     replace(filename.begin(), filename.end(), '\\', '=');
@@ -654,6 +1188,12 @@ STRING validchars(STRING filename) {
 #endif
 }
 
+// Path of a file in the archive, as a key for the files of the backup that -q is based on and for hard links
+STRING contents_key(const STRING &dir_name, const STRING &file) {
+    STRING curdir = remove_delimitor(dir_name);
+    return slashify(curdir == UNITXT("") ? file : curdir + DELIM_STR + file);
+}
+
 void read_content_item(FILE *file, contents_t *c) {
     c->name = slashify(io.readstr(file));
     c->link = slashify(io.readstr(file));
@@ -802,7 +1342,7 @@ void parse_flags(void) {
             abort(true, UNITXT("-s flag not supported in *nix"));
 #endif
         } else {
-            size_t e = flags.find_first_not_of(UNITXT("-hRroxcDupilLatgmv0123456789B"));
+            size_t e = flags.find_first_not_of(UNITXT("-hkRroxcDupilLatgmv0123456789BbdqIwjn"));
             if (e != string::npos) {
                 abort(true, UNITXT("Unknown flag -%s"), flags.substr(e, 1).c_str());
             }
@@ -810,8 +1350,8 @@ void parse_flags(void) {
             string flagsS = wstring2string(flags);
 
             // abort if numeric digits are used with a wrong flag
-            if (regx(flagsS, "[^mgtvix0123456789][0-9]+") != "") {
-                abort(true, UNITXT("Numeric values must be preceded by m, g, t, v, or x"));
+            if (regx(flagsS, "[^mgtvixbdqj0123456789][0-9]+") != "") {
+                abort(true, UNITXT("Numeric values must be preceded by m, g, t, v, x, b, d, q or j"));
             }
 
             if (regx(flagsS, "R") != "") {
@@ -847,6 +1387,23 @@ void parse_flags(void) {
             if (regx(flagsS, "h") != "") {
                 hash_flag = true;
             }
+            if (regx(flagsS, "k") != "") {
+                compact_flag = true;
+            }
+            if (regx(flagsS, "q") != "") {
+                quick_flag = true;
+                string f = regx(flagsS, "q\\d+");
+                quick_verify = f == "" ? 0 : atoi(f.substr(1).c_str());
+            }
+            if (regx(flagsS, "I") != "") {
+                incremental_flag = true;
+            }
+            if (regx(flagsS, "w") != "") {
+                whole_flag = true;
+            }
+            if (regx(flagsS, "n") != "") {
+                interleave_flag = false;
+            }
             if (regx(flagsS, "B") != "") {
                 // "2024-01-04T09:27:05+0100"
                 STRING td = UNITXT(_TIMEZ_);
@@ -864,6 +1421,20 @@ void parse_flags(void) {
                 }
             }
 
+            if (int_flag(flagsS, "b") != -1) {
+                readahead_mb = int_flag(flagsS, "b");
+            }
+
+            if (int_flag(flagsS, "j") != -1) {
+                open_files = int_flag(flagsS, "j");
+                abort(open_files == 0, UNITXT("-j flag value must be at least 1"));
+            }
+
+            if (int_flag(flagsS, "d") != -1) {
+                cache_flag = int_flag(flagsS, "d");
+                abort(cache_flag > CACHE_DIRECT, UNITXT("-d flag value must be 0...2"));
+            }
+
             if (int_flag(flagsS, "g") != -1) {
                 gigabyte_flag = int_flag(flagsS, "g");
 
@@ -906,28 +1477,64 @@ void parse_flags(void) {
     // todo, add s and p verification
     abort(megabyte_flag != 0 && gigabyte_flag != 0, UNITXT("-m flag not compatible with -g"));
     abort(restore_flag && (!recursive_flag || continue_flag), UNITXT("-R flag not compatible with -n or -c"));
-    abort(restore_flag && (megabyte_flag != 0 || gigabyte_flag != 0), UNITXT("-m and -t flags not applicable to restore (no memory required)"));
     abort(restore_flag && (threads_flag != 0), UNITXT("-t flag not supported for restore"));
-    abort(diff_flag && compress_flag && (megabyte_flag != 0 || gigabyte_flag != 0), UNITXT("-m and -t flags not applicable to differential backup (uses "
-                                                                                           "same memory as full)"));
+    abort(incremental_flag && (megabyte_flag != 0 || gigabyte_flag != 0), UNITXT("-m and -g flags not applicable to incremental backup (uses "
+                                                                               "same memory as full)"));
     abort(hash_flag && diff_flag, UNITXT("-h flag not applicable to differential backup"));
     abort(hash_flag && !compress_flag, UNITXT("-h flag not applicable to restore"));
+    abort(compact_flag && diff_flag, UNITXT("-k flag not applicable to differential backup"));
+    abort(compact_flag && !compress_flag, UNITXT("-k flag not applicable to restore"));
+    abort(quick_flag && !(diff_flag && compress_flag), UNITXT("-q flag only applicable to differential backup"));
+    abort(incremental_flag && !(diff_flag && compress_flag), UNITXT("-I flag only applicable to differential backup"));
+    abort(whole_flag && !compress_flag, UNITXT("-w flag not applicable to restore"));
+    abort(!interleave_flag && !compress_flag, UNITXT("-n flag not applicable to restore"));
 }
 
 void add_item(const STRING &item) {
     if (item.size() >= 2 && item.substr(0, 2) == UNITXT("--")) {
         STRING e = item.substr(2);
-        e = remove_delimitor(CASESENSE(abs_path(e)));
-        if (!(exists(e))) {
-            statusbar.print(2, UNITXT("Excluded item '%s' does not exist"), e.c_str());
+        size_t wildcard = e.find_first_of(UNITXT("*?"));
+        if (wildcard == STRING::npos) {
+            e = remove_delimitor(CASESENSE(abs_path(e)));
+            if (!(exists(e))) {
+                statusbar.print(2, UNITXT("Excluded item '%s' does not exist"), e.c_str());
+            } else {
+                exclude_paths.insert(e);
+            }
         } else {
-            excludelist.push_back(e);
+            // Normalize the part in front of the first wildcard, which must exist
+            size_t d = e.find_last_of(UNITXT("/\\"), wildcard);
+            STRING dir = d == STRING::npos ? UNITXT(".") : e.substr(0, d + 1);
+            STRING pattern = d == STRING::npos ? e : e.substr(d + 1);
+            STRING parent = abs_path(dir);
+            if (parent == UNITXT("")) {
+                statusbar.print(2, UNITXT("Excluded item '%s' does not exist"), dir.c_str());
+            } else {
+                e = remove_delimitor(CASESENSE(remove_delimitor(parent) + DELIM_STR + slashify(pattern)));
+                size_t depth = std::count(e.begin(), e.end(), DELIM_CHAR);
+                if (exclude_patterns.size() <= depth) {
+                    exclude_patterns.resize(depth + 1);
+                }
+                exclude_patterns[depth].push_back(e);
+            }
         }
     } else {
         inputfiles.push_back(item);
     }
 }
 
+// Tells the .diff files of a chain apart from the destination directory on restore
+bool is_diff_archive(const STRING &path) {
+    FILE *f = io.open(path, 'r');
+    if (!f) {
+        return false;
+    }
+    char magic[8];
+    bool r = io.read(magic, 8, f) == 8 && equal2(magic, "EXDUPE D", 8);
+    io.close(f);
+    return r;
+}
+
 void parse_files(void) {
     if (compress_flag && !diff_flag) {
         for (int i = flags_exist + 1; i < argc - 1; i++) {
@@ -981,19 +1588,26 @@ void parse_files(void) {
     } else if (!compress_flag && diff_flag) {
         abort(argc - 1 < flags_exist + 3, UNITXT("Missing arguments. ") RESTORE_DIFFERENTIAL_BACKUP);
         full = argv.at(1 + flags_exist);
-        diff = argv.at(2 + flags_exist);
-        directory = argv.at(3 + flags_exist);
+
+        // A chain of incremental backups is told apart from the destination, which is never a .diff file
+        int d = 2 + flags_exist;
+        diffs.push_back(argv.at(d++));
+        while (d < argc - 1 && is_diff_archive(argv.at(d))) {
+            diffs.push_back(argv.at(d++));
+        }
+        diff = diffs.back();
+        directory = argv.at(d);
 
         abort(full == UNITXT("-stdin") || diff == UNITXT("-stdin"), UNITXT("-stdin is not supported for restoring differential backup. ") RESTORE_FULL_BACKUP);
 
-        for (int i = 0; i < argc - 4 - flags_exist; i++) {
-            restorelist.push_back(argv.at(i + 4 + flags_exist));
+        for (int i = d + 1; i < argc; i++) {
+            restorelist.push_back(argv.at(i));
         }
 
         //	abort(directory == UNITXT("-stdout"), UNITXT("Restore to stdout
         // or non-seekable drive not supported"));
 
-        abort(full == UNITXT("-stdout") || diff == UNITXT("-stdout") || (full == UNITXT("-stdin") && diff == UNITXT("-stdin")) || (argc < 4 + flags_exist),
+        abort(full == UNITXT("-stdout") || diff == UNITXT("-stdout") || (full == UNITXT("-stdin") && diff == UNITXT("-stdin")),
               UNITXT("Syntax error in source or destination. ") RESTORE_DIFFERENTIAL_BACKUP);
     } else if (list_flag) {
         full = argv[1 + flags_exist];
@@ -1050,11 +1664,39 @@ void print_usage()
 	UNITXT("    -gn Use n GB memory for a hash table (default = 2). Use -mn to specify\n")
 	UNITXT("        number of MB instead. Use 2 to 8 GB per TB of input data for best\n")
     UNITXT("        compression ratio. Differential backups will use the same memory as the\n")
-    UNITXT("        full backup.\n")
+    UNITXT("        full backup, plus n GB for a table of their own data if given, so that\n")
+    UNITXT("        data that is new since the full backup is deduplicated too. On\n")
+    UNITXT("        restore, sets the size of the cache of restored data instead (default\n")
+    UNITXT("        = 256 MB)\n")
     UNITXT("    -tn Use n threads (default = ") + str(threads) + UNITXT(")\n")
+    UNITXT("    -bn Read up to n MB of source files ahead on separate threads (default = ") + str(readahead_mb) + UNITXT(").\n")
+    UNITXT("        Use -b0 to disable\n")
+    UNITXT("    -dn Spare the page cache for other processes. 1 = drop source files and the\n")
+    UNITXT("        archive from the cache once read or written, 2 = use O_DIRECT where\n")
+    UNITXT("        possible\n")
+    UNITXT("    -jn Keep up to n restored files open for reading back data that they\n")
+    UNITXT("        share with later files on restore from stdin (default = ") + str(open_files) + UNITXT(")\n")
 	UNITXT("    -vn Verbose level 0 = quiet, 1 = status bar, 2 = skipped files, 3 = verbose\n")
 	UNITXT("    -h  Use slower cryptographic hash BLAKE3. Default is xxHash128\n")
-	UNITXT("     -- Prefix items in the <sources> list with \"--\" to exclude them\n\n")  
+	UNITXT("    -k  Use compact hash table entries that index almost twice as much data per\n")
+	UNITXT("        GB. Blocks are then told apart by 64 instead of 144 bits of hash, which\n")
+	UNITXT("        raises the odds of an undetected collision to about 1 in 2^48 lookups.\n")
+	UNITXT("        Limited to 256 TB of input\n")
+    UNITXT("     -n Don't interleave the hash table across NUMA nodes. Use -v3 to see how it\n")
+    UNITXT("        was placed\n")
+	UNITXT("     -q Differential backup: Do not read files whose size, date and attributes\n")
+	UNITXT("        are the same as in the .full file. Dates have a resolution of 1 second.\n")
+	UNITXT("        Use -qn to read and verify every n'th of the skipped files anyway\n")
+	UNITXT("     -I Incremental differential backup: Also deduplicate against, and store\n")
+	UNITXT("        only what changed since, the previous incremental backup of the chain\n")
+	UNITXT("        that is passed instead of the .full file. The first one is passed the\n")
+	UNITXT("        .full file\n")
+	UNITXT("     -w Store files of 64 KB or more that are identical to an earlier file of\n")
+	UNITXT("        the same backup as a single reference to it, without deduplicating them\n")
+	UNITXT("        block by block. Costs two small reads per file and a second read of\n")
+	UNITXT("        files that only begin and end like an earlier one\n")
+	UNITXT("     -- Prefix items in the <sources> list with \"--\" to exclude them. Can contain\n")
+	UNITXT("        wildcards * and ? that match within a single directory level\n\n")
 	UNITXT("Quick example of backup, differential backups and a restore:\n")
 #ifdef WINDOWS
     UNITXT("   eXdupe z:\\database\\ database.full\n")
@@ -1072,11 +1714,17 @@ void print_usage()
 	UNITXT("   eXdupe -stdin database.mdf -stdout < database.mdf > database.full\n")
 	UNITXT("   eXdupe -m256t2 z:\\vmdk\\win\\ z:\\vmdk\\mac\\ z:\\vmdk\\hpux\\ servers.full\n")
 	UNITXT("   eXdupe -RD servers.full servers.diff z:\\restored mac win\n")
+	UNITXT("   eXdupe -DI z:\\mail\\ mail.full mail.diff1\n")
+	UNITXT("   eXdupe -DI z:\\mail\\ mail.diff1 mail.diff2\n")
+	UNITXT("   eXdupe -RD mail.full mail.diff1 mail.diff2 z:\\mail\\restored\\\n")
 	UNITXT("   eXdupe -c -f\"return(dir or size < 1000000)\" z:\\stuff stuff.full\n")
 	UNITXT("   eXdupe -s\"c:\" c:\\ --c:\\pagefile.sys system.full\n")
 #else
 	UNITXT("   eXdupe -stdin database.mdf -stdout < database.mdf > database.full\n")
 	UNITXT("   eXdupe -g16 /mail/ -stdout > mail.full\n")
+	UNITXT("   eXdupe -DI /mail/ mail.full mail.diff1\n")
+	UNITXT("   eXdupe -DI /mail/ mail.diff1 mail.diff2\n")
+	UNITXT("   eXdupe -RD mail.full mail.diff1 mail.diff2 /mail/restored/\n")
 	UNITXT("   eXdupe -m256t2 /vmdk/win/ /vmdk/mac/ /vmdk/hpux/ servers.full\n")
 	UNITXT("   eXdupe -RD servers.full servers.diff /vmdk/restored mac win\n")
 	UNITXT("   eXdupe /stuff -f\"return(dir or size < 1000000)\" stuff.full\n")
@@ -1111,6 +1759,36 @@ FILE *try_open(STRING file2, char mode, bool abortfail) {
     return f;
 }
 
+// Returns a handle to the restored file infiles[fo], reusing an open one if possible. The least recently used handle is
+// closed when more than open_files would be open
+FILE *infile_handle(size_t fo) {
+    file_offset_t &f = infiles[fo];
+    if (f.handle) {
+        open_infiles.splice(open_infiles.begin(), open_infiles, f.lru);
+        return f.handle;
+    }
+
+    while (!open_infiles.empty() && open_infiles.size() >= open_files) {
+        file_offset_t &victim = infiles[open_infiles.back()];
+        fclose(victim.handle);
+        victim.handle = 0;
+        open_infiles.pop_back();
+    }
+
+    f.handle = try_open(f.filename, 'r', true);
+    open_infiles.push_front(fo);
+    f.lru = open_infiles.begin();
+    return f.handle;
+}
+
+void close_infiles() {
+    for (size_t fo : open_infiles) {
+        fclose(infiles[fo].handle);
+        infiles[fo].handle = 0;
+    }
+    open_infiles.clear();
+}
+
 STRING parent_path(const vector<STRING> &items) {
     size_t prefix = longest_common_prefix(items, !WIN);
     if (prefix == 0) {
@@ -1144,7 +1822,7 @@ pair<STRING, size_t> extract_to(STRING curdir, STRING curfile) {
     STRING curdir_case = CASESENSE(slashify(curdir));
     curfile = CASESENSE(curfile);
 
-    STRING p = parent_path(restorelist);
+    const STRING &p = restore_parent;
     size_t prefix = p.size();
 
     for (uint32_t i = 0; i < restorelist.size(); i++) {
@@ -1246,15 +1924,23 @@ void create_symlink(STRING path, contents_t c) {
 }
 #endif
 
-void decompress_individuals(FILE *ffull, FILE *fdiff) {
-    FILE *archive_file;
-    bool pipe_out = directory == UNITXT("-stdout");
+// Restores a file of the archive as a hard link to target, the already restored first link to the same data
+void create_hardlink(const STRING &target, const STRING &path) {
+    already_exists(path);
+#ifdef WINDOWS
+    DeleteFileW(path.c_str());
+    bool ok = CreateHardLinkW(path.c_str(), target.c_str(), nullptr);
+#else
+    unlink(path.c_str());
+    bool ok = link(target.c_str(), path.c_str()) == 0;
+#endif
+    abort(!ok, UNITXT("Error creating hard link '%s' to '%s'"), path.c_str(), target.c_str());
+}
 
-    if (diff_flag) {
-        archive_file = fdiff;
-    } else {
-        archive_file = ffull;
-    }
+// archives is the .full followed by the chain of differential backups to restore the last of, if any
+void decompress_individuals(const vector<FILE *> &archives) {
+    FILE *archive_file = archives.back();
+    bool pipe_out = directory == UNITXT("-stdout");
 
     uint64_t orig = seek_to_header(archive_file, "CONTENTS");
     uint64_t payload = 0;
@@ -1273,26 +1959,46 @@ void decompress_individuals(FILE *ffull, FILE *fdiff) {
         restorelist[i] = CASESENSE(restorelist[i]);
     }
 
-    if (diff_flag) {
-        basepay = read_references(ffull, 0);
-        read_references(fdiff, basepay);
-    } else {
-        basepay = read_references(ffull, 0);
+    // Each differential backup starts where the archives before it end
+    uint64_t chain_end = 0;
+    for (size_t i = 0; i < archives.size(); i++) {
+        if (i > 0) {
+            abort(read_diff_base(archives[i]) != chain_end, UNITXT("'%s' does not follow '%s'. Pass the .full and every incremental backup up to the one "
+                                                                   "to restore, in the order they were made"),
+                  slashify(diffs[i - 1]).c_str(), slashify(i == 1 ? full : diffs[i - 2]).c_str());
+        }
+        basepay = chain_end;
+        chain_end += read_references(archives[i], chain_end);
     }
 
+    restore_parent = parent_path(restorelist);
+
     uint64_t n = io.read_ui<uint64_t>(archive_file);
-    for (uint64_t i = 0; i < n; i++) {
-        read_content_item(archive_file, &c);
-        content.push_back(c);
+    vector<uint64_t> offsets;
+    if (restorelist.size() > 0 && lookup_paths(archive_file, restorelist, offsets)) {
+        uint64_t section = io.tell(archive_file) - 8;
+        for (uint64_t o : offsets) {
+            if (io.tell(archive_file) != section + o) {
+                io.seek(archive_file, section + o, SEEK_SET);
+            }
+            read_content_item(archive_file, &c);
+            content.push_back(c);
+        }
+    } else {
+        for (uint64_t i = 0; i < n; i++) {
+            read_content_item(archive_file, &c);
+            content.push_back(c);
+        }
     }
 
     verify_restorelist(restorelist, content);
 
+    // Restored files by their path in the archive, for the later hard links to them
+    std::unordered_map<STRING, STRING> restored;
+
     for (uint32_t i = 0; i < content.size(); i++) {
         c = content[i];
-        if (diff_flag) {
-            c.payload += basepay;
-        }
+        c.payload += basepay;
 
         if (c.directory) {
             curdir = remove_delimitor(c.name);
@@ -1333,24 +2039,39 @@ void decompress_individuals(FILE *ffull, FILE *fdiff) {
                     statusbar.update(RESTORE, 0, tot_res, c.name + " -> " + c.link);
                     create_symlink(dstdir + DELIM_STR + c.name, c);
 #endif
+                } else if (!pipe_out && c.link != UNITXT("") && restored.contains(c.link)) {
+                    STRING outfile = remove_delimitor(abs_path(dstdir)) + DELIM_STR + c.name;
+                    statusbar.update(RESTORE, 0, tot_res, outfile);
+                    create_hardlink(restored[c.link], outfile);
+                    tot_res += c.size;
+                    files++;
                 } else {
                     STRING outfile = remove_delimitor(abs_path(dstdir)) + DELIM_STR + c.name;
                     statusbar.update(RESTORE, 0, tot_res, outfile);
+                    if (!pipe_out) {
+                        restored[contents_key(curdir, c.name)] = outfile;
+                    }
 
                     ofile = pipe_out ? stdout : open_destination(outfile);
 
                     resolved = 0;
 
                     while (resolved < c.size) {
-                        size_t process = minimum(c.size - resolved, RESTORE_CHUNKSIZE);
-
-                        resolve(c.payload + resolved, process, extract_concatenate, ffull, fdiff, basepay);
-
-                        checksum(extract_concatenate, process, &t);
-                        io.write(extract_concatenate, process, ofile);
-                        tot_res += process;
+                        size_t batch = minimum(c.size - resolved, RESTORE_BATCH);
+                        vector<char> holes;
+
+                        resolve(c.payload + resolved, batch, extract_concatenate, holes);
+
+                        checksum_restored(extract_concatenate, batch, &t, threads);
+                        for (size_t i = 0; i < batch; i += RESTORE_CHUNKSIZE) {
+                            size_t process = minimum(batch - i, RESTORE_CHUNKSIZE);
+                            if (!holes[i / RESTORE_CHUNKSIZE] || pipe_out || !io.write_hole(process, ofile)) {
+                                io.write(extract_concatenate + i, process, ofile);
+                            }
+                        }
+                        tot_res += batch;
                         statusbar.update(RESTORE, 0, tot_res, outfile);
-                        resolved += process;
+                        resolved += batch;
                         payload += c.size;
                     }
                     if (!pipe_out) {
@@ -1365,7 +2086,7 @@ void decompress_individuals(FILE *ffull, FILE *fdiff) {
         }
     }
 
-    io.seek(ffull, orig, SEEK_SET);
+    io.seek(archive_file, orig, SEEK_SET);
 }
 
 uint64_t payload_written = 0;
@@ -1373,6 +2094,25 @@ uint64_t add_file_payload = 0;
 uint64_t curfile_written = 0;
 uint64_t current_outfile_begin = 0;
 checksum_t decompress_checksum;
+bool linked = false; // the file being restored by decompress_files() is a hard link, so nothing is written
+
+// Writes len bytes of the same value to a file that is being restored. Zero runs become holes if the destination
+// supports it
+void write_fill(unsigned char value, uint64_t len, FILE *file, checksum_t *t) {
+    static unsigned char fill[64 * K];
+    if (value == 0 && io.write_hole(len, file)) {
+        checksum_zeros(len, t);
+        return;
+    }
+
+    memset(fill, value, minimum(len, sizeof(fill)));
+    for (uint64_t written = 0; written < len;) {
+        size_t n = minimum(len - written, sizeof(fill));
+        checksum(fill, n, t);
+        io.try_write(fill, n, file);
+        written += n;
+    }
+}
 
 void decompress_files(vector<contents_t> &c, bool add_files) {
     STRING destfile;
@@ -1391,7 +2131,7 @@ void decompress_files(vector<contents_t> &c, bool add_files) {
         }
 
         io.try_read(in + 1, 7, ifile);
-        assert((in[0] == 'T' && in[1] == 'T') || (in[0] == 'M' && in[1] == 'M'));
+        assert((in[0] == 'T' && in[1] == 'T') || (in[0] == 'M' && in[1] == 'M') || (in[0] == 'F' && in[1] == 'F'));
 
         io.try_read(in + 8, (32 - 6 - 8) - 8, ifile);
         len = dup_size_compressed(in);
@@ -1400,80 +2140,114 @@ void decompress_files(vector<contents_t> &c, bool add_files) {
         abort(r == -1 || r == -2, UNITXT("Internal error, dup_decompress() = %p"), r);
 
         assert(c.size() > 0);
-        payload_orig = c[0].payload;
 
-        if (r == 0) {
-            // dup_decompress() wrote literal at the destination, nothing we need to do
-        } else if (r == 1) {
-            // dup_decompress() returned a reference into a past written file
-            size_t resolved = 0;
-            while (resolved < len) {
-                if (payload + resolved >= payload_orig && add_files) {
-                    size_t fo = belongs_to(payload + resolved);
-                    int j = io.seek(ofile, payload + resolved - payload_orig, SEEK_SET);
-                    abort(j != 0, UNITXT("Internal error 1 or non-seekable device: seek(%s, %p, %p)"), infiles[fo].filename.c_str(), payload, payload_orig);
-                    len2 = io.read(out + resolved, len - resolved, ofile);
-                    abort(len2 != len - resolved, UNITXT("Internal error 2: read(%s, %p, %p)"), infiles[fo].filename.c_str(), len, len2);
-                    resolved += len2;
-                    io.seek(ofile, 0, SEEK_END);
-                } else {
-                    FILE *ifile2;
-                    size_t fo = belongs_to(payload + resolved);
-                    {
-                        ifile2 = try_open(infiles[fo].filename, 'r', true);
-                        infiles[fo].handle = ifile2;
-                        int j = io.seek(ifile2, payload + resolved - infiles[fo].offset, SEEK_SET);
-                        abort(j != 0, UNITXT("Internal error 9 or destination is a non-seekable device: seek(%s, %p, %p)"), infiles[fo].filename.c_str(),
-                              payload, infiles[fo].offset);
+        // Writes n bytes of the packet, at src unless it's a fill, to the files at the front of c
+        auto write_files = [&](unsigned char *src, uint64_t n) {
+            uint64_t src_consumed = 0;
+
+            while (c.size() > 0 && src_consumed < n) {
+                if (ofile == 0 && !linked) {
+                    if (c[0].link != UNITXT("")) {
+                        create_hardlink(c[0].link, c[0].extra);
+                        linked = true;
+                    } else {
+                        ofile = open_destination(c[0].extra);
                     }
-                    len2 = io.read(out + resolved, len - resolved, ifile2);
-                    resolved += len2;
-                    fclose(ifile2);
-                }
-            }
-        } else {
-            abort(true, UNITXT("Internal errror or source file corrupted: %d"), r);
-        }
-
-        uint64_t src_consumed = 0;
+                    destfile = c[0].extra;
+                    files++;
+                    checksum_init(&decompress_checksum);
 
-        while (c.size() > 0 && src_consumed < len) {
-            if (ofile == 0) {
-                ofile = open_destination(c[0].extra);
-                destfile = c[0].extra;
-                files++;
-                checksum_init(&decompress_checksum);
+                    if (add_files) {
+                        add_file(c[0].extra, add_file_payload);
+                        add_file_payload += c[0].size;
+                    }
 
-                if (add_files) {
-                    add_file(c[0].extra, add_file_payload);
-                    add_file_payload += c[0].size;
+                    curfile_written = 0;
                 }
 
-                curfile_written = 0;
-            }
+                auto missing = c[0].size - curfile_written;
+                auto has = minimum(missing, n - src_consumed);
+                if (r == 2) {
+                    window_fill(static_cast<unsigned char>(payload), c[0].payload + curfile_written, has);
+                } else {
+                    window_add(src + src_consumed, c[0].payload + curfile_written, has);
+                }
+                curfile_written += has;
 
-            auto missing = c[0].size - curfile_written;
-            auto has = minimum(missing, len - src_consumed);
-            curfile_written += has;
+                statusbar.update(RESTORE, 0, dup_counter_payload(), destfile);
 
-            statusbar.update(RESTORE, 0, dup_counter_payload(), destfile);
+                if (linked) {
+                    // The first link was verified when it was restored
+                } else if (r == 2) {
+                    write_fill(static_cast<unsigned char>(payload), has, ofile, &decompress_checksum);
+                } else {
+                    io.try_write(src + src_consumed, has, ofile);
+                    checksum(src + src_consumed, has, &decompress_checksum);
+                }
 
-            io.try_write(out + src_consumed, has, ofile);
-            checksum(out + src_consumed, has, &decompress_checksum);
+                payload_written += has;
+                src_consumed += has;
 
-            payload_written += has;
-            src_consumed += has;
+                if (curfile_written == c[0].size) {
+                    current_outfile_begin += c[0].size;
 
-            if (curfile_written == c[0].size) {
-                current_outfile_begin += c[0].size;
+                    if (linked) {
+                        linked = false;
+                    } else {
+                        io.close(ofile);
+                        abort(c[0].checksum != decompress_checksum.result, UNITXT("File checksum error"));
+                    }
+                    ofile = 0;
+                    curfile_written = 0;
 
-                io.close(ofile);
-                ofile = 0;
-                curfile_written = 0;
-                abort(c[0].checksum != decompress_checksum.result, UNITXT("File checksum error"));
+                    c.erase(c.begin());
+                }
+            }
+        };
 
-                c.erase(c.begin());
+        if (r == 0) {
+            // dup_decompress() wrote literal at the destination
+            write_files(out, len);
+        } else if (r == 1) {
+            // dup_decompress() returned a reference into a past written file. It can be larger than 'out', such as one of
+            // dup_compress_reference(), and is then resolved and written in pieces. Pieces of recently written payload are
+            // copied from the window instead of read back from the destination
+            for (uint64_t piece = 0; piece < len; piece += DISK_READ_CHUNK) {
+                size_t piece_len = minimum(len - piece, DISK_READ_CHUNK);
+                uint64_t piece_payload = payload + piece;
+                payload_orig = c[0].payload;
+                size_t resolved = 0;
+                if (window_find(out, piece_payload, piece_len)) {
+                    resolved = piece_len;
+                }
+                while (resolved < piece_len) {
+                    if (piece_payload + resolved >= payload_orig && add_files) {
+                        size_t fo = belongs_to(piece_payload + resolved);
+                        int j = io.seek(ofile, piece_payload + resolved - payload_orig, SEEK_SET);
+                        abort(j != 0, UNITXT("Internal error 1 or non-seekable device: seek(%s, %p, %p)"), infiles[fo].filename.c_str(), piece_payload,
+                              payload_orig);
+                        len2 = io.read(out + resolved, piece_len - resolved, ofile);
+                        abort(len2 != piece_len - resolved, UNITXT("Internal error 2: read(%s, %p, %p)"), infiles[fo].filename.c_str(), piece_len, len2);
+                        resolved += len2;
+                        io.seek(ofile, 0, SEEK_END);
+                    } else {
+                        size_t fo = belongs_to(piece_payload + resolved);
+                        FILE *ifile2 = infile_handle(fo);
+                        int j = io.seek(ifile2, piece_payload + resolved - infiles[fo].offset, SEEK_SET);
+                        abort(j != 0, UNITXT("Internal error 9 or destination is a non-seekable device: seek(%s, %p, %p)"),
+                              infiles[fo].filename.c_str(), piece_payload, infiles[fo].offset);
+                        len2 = io.read(out + resolved, piece_len - resolved, ifile2);
+                        resolved += len2;
+                    }
+                }
+                write_files(out, piece_len);
             }
+        } else if (r == 2) {
+            // dup_decompress() returned a run of identical bytes. It can be larger than 'out' and is written by write_fill()
+            // instead
+            write_files(nullptr, len);
+        } else {
+            abort(true, UNITXT("Internal errror or source file corrupted: %d"), r);
         }
     }
 }
@@ -1519,21 +2293,184 @@ void compress_symlink(const STRING &link, const STRING &target) {
 }
 #endif
 
+// Files of the archive that a differential backup is based on by path, for -q
+std::unordered_map<STRING, contents_t> full_contents;
+uint64_t quick_skipped = 0;
+
+void load_full_contents(FILE *file, uint64_t base_payload) {
+    uint64_t orig = seek_to_header(file, "CONTENTS");
+    uint64_t n = io.read_ui<uint64_t>(file);
+    STRING curdir;
+    for (uint64_t i = 0; i < n; i++) {
+        contents_t c;
+        read_content_item(file, &c);
+        if (c.directory) {
+            curdir = c.name;
+        } else if (!c.symlink) {
+            c.payload += base_payload;
+            c.link = UNITXT("");
+            full_contents[contents_key(curdir, c.name)] = c;
+        }
+    }
+    io.seek(file, orig, SEEK_SET);
+}
+
+// Returns the entry of the base archive if the file at path seems unchanged since then. Every quick_verify'th such file is
+// read to check that its data is indeed the same
+const contents_t *unchanged_file(const STRING &path, const STRING &dir_name, const STRING &filename, const walk_entry_t &meta) {
+    auto it = full_contents.find(contents_key(dir_name, filename));
+    if (it == full_contents.end()) {
+        return nullptr;
+    }
+    const contents_t &c = it->second;
+    const tm &a = c.file_date;
+    const tm &b = meta.date;
+    if (meta.size == 0 || c.size != meta.size || c.attributes != meta.attributes || a.tm_year != b.tm_year || a.tm_mon != b.tm_mon ||
+        a.tm_mday != b.tm_mday || a.tm_hour != b.tm_hour || a.tm_min != b.tm_min || a.tm_sec != b.tm_sec) {
+        return nullptr;
+    }
+
+    quick_skipped++;
+    if (quick_verify > 0 && quick_skipped % quick_verify == 0) {
+        FILE *f = io.open(path, 'r');
+        if (!f) {
+            return nullptr;
+        }
+        checksum_t t;
+        checksum_init(&t);
+        vector<unsigned char> buf(DISK_READ_CHUNK);
+        size_t r;
+        while ((r = io.read(buf.data(), buf.size(), f)) > 0) {
+            checksum(buf.data(), r, &t);
+        }
+        io.close(f);
+        if (t.result != c.checksum) {
+            statusbar.print(2, UNITXT("Changed despite same size and date: %s"), path.c_str());
+            quick_skipped--;
+            return nullptr;
+        }
+    }
+    return &c;
+}
+
+// First occurrence of each file with more than one hard link, by device and inode. Later links are stored as references
+// to its payload and restored as hard links to it. Its link member is its path in the archive, empty until compressed
+std::map<std::pair<uint64_t, uint64_t>, contents_t> hard_links;
+
+// Files of at least WHOLE_MIN bytes in this backup by size and a hash of their first and last WHOLE_EDGE bytes, for -w. A
+// later file with the same key and the same hash of all its data is stored as a single reference to the payload of the first
+const uint64_t WHOLE_MIN = 64 * K;
+const size_t WHOLE_EDGE = 4 * K;
+
+typedef struct {
+    contents_t c;
+    unsigned char hash[DUP_HASH_SIZE];
+} whole_file_t;
+
+std::map<std::pair<uint64_t, uint64_t>, vector<whole_file_t>> whole_files;
+
+bool whole_key(const STRING &path, uint64_t size, std::pair<uint64_t, uint64_t> &key) {
+    FILE *f = io.open(path, 'r');
+    if (!f) {
+        return false;
+    }
+    unsigned char edges[2 * WHOLE_EDGE];
+    size_t r = io.read(edges, WHOLE_EDGE, f);
+    io.seek(f, size - WHOLE_EDGE, SEEK_SET);
+    r += io.read(edges + r, WHOLE_EDGE, f);
+    io.close(f);
+    if (r != sizeof(edges)) {
+        return false;
+    }
+
+    unsigned char digest[DUP_HASH_SIZE];
+    dup_hash *h = dup_hash_create();
+    dup_hash_update(h, edges, sizeof(edges));
+    dup_hash_digest(h, digest);
+    uint64_t v;
+    memcpy(&v, digest, sizeof(v));
+    key = {size, v};
+    return true;
+}
+
+// Returns the earlier file with the same key and data, if any. Candidates are read in full, taking the chunks that were
+// read ahead, so a file that turns out to differ is read twice
+const contents_t *whole_duplicate(const STRING &path, uint64_t size, const std::pair<uint64_t, uint64_t> &key, ReadAhead *reader) {
+    auto it = whole_files.find(key);
+    if (it == whole_files.end()) {
+        return nullptr;
+    }
+
+    static vector<unsigned char> buf(DISK_READ_CHUNK);
+    FILE *f = nullptr;
+    dup_hash *h = dup_hash_create();
+    uint64_t done = 0;
+    while (done < size) {
+        size_t len = minimum(size - done, DISK_READ_CHUNK);
+        if (!(reader && reader->get(path, done, len, buf.data()))) {
+            if (!f) {
+                f = io.open(path, 'r');
+                if (!f) {
+                    break;
+                }
+            }
+            io.seek(f, done, SEEK_SET);
+            len = io.read(buf.data(), len, f);
+            if (len == 0) {
+                break;
+            }
+        }
+        dup_hash_update(h, buf.data(), len);
+        done += len;
+    }
+    if (f) {
+        io.close(f);
+    }
+
+    unsigned char digest[DUP_HASH_SIZE];
+    dup_hash_digest(h, digest);
+    if (done == size) {
+        for (auto &w : it->second) {
+            if (memcmp(w.hash, digest, DUP_HASH_SIZE) == 0) {
+                return &w.c;
+            }
+        }
+    }
+    return nullptr;
+}
+
 uint64_t payload_compressed = 0; // Total payload returned by dup_compress() and flush_pend()
 uint64_t payload_read = 0;       // Total payload read from disk
-string payload_queue;            // Queue of payload read from disk. Can contain multiple small files
+unsigned char *payload_queue;    // Queue of payload read from disk. Can contain multiple small files that are read straight
+size_t payload_queued = 0;       // into this DISK_READ_CHUNK sized arena, so that a solid chunk needs no allocations
+uint64_t reference_source = 0;   // Run of adjacent files that are stored as references to contiguous earlier payload,
+uint64_t reference_size = 0;     // which is written as one reference when a file that doesn't continue it comes along
 vector<contents_t> file_queue;
 
-void compress_file(const STRING &input_file, const STRING &filename, const bool flush = true) {
+// meta holds the attributes, size and date already gathered by the directory walk, so that they aren't queried again.
+// If unchanged is set, the file is not read but stored as a reference to the same file in the archive that the backup is based on,
+// or to an earlier hard link to it in this archive, which unchanged->link then names. If whole is set, the data is also added
+// to it for -w
+void compress_file(const STRING &input_file, const STRING &filename, const bool flush = true, const walk_entry_t *meta = nullptr,
+                   ReadAhead *reader = nullptr, const contents_t *unchanged = nullptr, dup_hash *whole = nullptr) {
 
-    if (input_file != UNITXT("-stdin") && ISNAMEDPIPE(get_attributes(input_file, follow_symlinks)) && !named_pipes) {
+    if (input_file != UNITXT("-stdin") && ISNAMEDPIPE(meta ? meta->attributes : get_attributes(input_file, follow_symlinks)) && !named_pipes) {
         statusbar.print(2, UNITXT("Skipped, no -p flag for named pipes: %s"), input_file.c_str());
         return;
     }
 
-    ifile = try_open(input_file.c_str(), 'r', false);
+    // Small files that were read ahead land in the queue without being opened here
+    checksum_part_t prefetched_part;
+    bool prefetched = !unchanged && meta && reader && meta->size > 0 && meta->size <= DISK_READ_CHUNK - payload_queued &&
+                      reader->get(input_file, 0, meta->size, payload_queue + payload_queued, &prefetched_part);
+
+    ifile = prefetched || unchanged ? 0 : try_open(input_file.c_str(), 'r', false);
+    if (ifile && input_file != UNITXT("-stdin")) {
+        // Our own reads are buffered, so O_DIRECT is reserved for the read-ahead threads and this handle drops pages instead
+        io.cache_sequential(ifile, cache_flag == CACHE_DIRECT ? CACHE_DROP : cache_flag);
+    }
 
-    if (!ifile) {
+    if (!ifile && !prefetched && !unchanged) {
         if (continue_flag) {
             statusbar.print(2, UNITXT("Skipped, error opening source file: %s"), input_file.c_str());
             return;
@@ -1554,7 +2491,12 @@ void compress_file(const STRING &input_file, const STRING &filename, const bool
 
     statusbar.update(BACKUP, dup_counter_payload(), io.write_count, input_file);
 
-    if (input_file != UNITXT("-stdin")) {
+    if (meta) {
+        // The walk can have stat'ed the file long before, so an open file is sized again in case it has changed since
+        file_size = ifile ? io.size(ifile) : meta->size;
+        file_date = meta->date;
+        attributes = meta->attributes;
+    } else if (input_file != UNITXT("-stdin")) {
         io.seek(ifile, 0, SEEK_END);
         file_size = io.tell(ifile);
         get_date(input_file, &file_date);
@@ -1566,6 +2508,7 @@ void compress_file(const STRING &input_file, const STRING &filename, const bool
     }
 
     file_meta.name = filename;
+    file_meta.link = unchanged ? unchanged->link : UNITXT("");
     file_meta.size = file_size;
     file_meta.file_date = file_date;
     file_meta.attributes = attributes;
@@ -1577,89 +2520,176 @@ void compress_file(const STRING &input_file, const STRING &filename, const bool
 
     files++;
 
+    auto write_packets = [&](size_t cc, uint64_t pay) {
+        payload_compressed += pay;
+        if (cc > 0) {
+            io.try_write("A", 1, ofile);
+            add_references(out, cc, io.write_count);
+            io.try_write(out, cc, ofile);
+            io.try_write("B", 1, ofile);
+        }
+    };
+
     auto empty_q = [&]() {
-        if (payload_queue.size() > 0) {
+        if (payload_queued > 0) {
             uint64_t pay;
-            size_t cc = dup_compress(payload_queue.c_str(), out, payload_queue.size(), &pay);
-            payload_compressed += pay;
-            if (cc > 0) {
-                io.try_write("A", 1, ofile);
-                add_references(out, cc, io.write_count);
-                io.try_write(out, cc, ofile);
-                io.try_write("B", 1, ofile);
+            size_t cc = dup_compress(payload_queue, out, payload_queued, &pay);
+            write_packets(cc, pay);
+            payload_queued = 0;
+        }
+    };
+
+    // The queue holds payload in front of the run of references, if any, so it's written first
+    auto empty_references = [&]() {
+        empty_q();
+        if (reference_size > 0) {
+            uint64_t pay;
+            size_t cc = dup_compress_reference(reference_source, reference_size, out, &pay);
+            write_packets(cc, pay);
+            reference_size = 0;
+        }
+    };
+
+    // Takes the chunk from the read-ahead threads if they got it, else reads it from our own handle. Adds it to the
+    // checksum of the file, which the read-ahead threads have mostly done already
+    bool ifile_behind = false;
+    auto read_chunk = [&](unsigned char *dst, size_t len) {
+        checksum_part_t part;
+        if (reader && reader->get(input_file, file_read, len, dst, &part)) {
+            ifile_behind = true;
+            if (!checksum_combine(&file_meta.ct, &part)) {
+                checksum(dst, len, &file_meta.ct);
             }
-            payload_queue.clear();
+            return len;
+        }
+        if (ifile_behind) {
+            io.seek(ifile, file_read, SEEK_SET);
+            ifile_behind = false;
+        }
+        size_t r = io.read_valid_length(dst, len, ifile, input_file);
+        if (cache_flag != CACHE_NORMAL && input_file != UNITXT("-stdin")) {
+            io.cache_drop(ifile, file_read, r);
+        }
+        checksum(dst, r, &file_meta.ct);
+        return r;
+    };
+
+    auto write_checksum = [&]() {
+        if (file_read == file_size && file_size > 0) {
+            // No CRC block for 0-sized files
+            io.try_write("C", 1, ofile);
+            file_meta.checksum = file_meta.ct.result;
+            io.write_ui<uint64_t>(file_meta.ct.result, ofile);
         }
     };
 
     io.try_write("F", 1, ofile);
     write_contents_item(ofile, &file_meta);
 
-    if (file_size > DISK_READ_CHUNK - payload_queue.size()) {
-        empty_q();
+    if (unchanged) {
+        if (file_size > 0 && (reference_size == 0 || unchanged->payload != reference_source + reference_size)) {
+            empty_references();
+            reference_source = unchanged->payload;
+        }
+        reference_size += file_size;
+        file_read = file_size;
+        payload_read += file_size;
+        file_meta.ct.result = unchanged->checksum;
+        write_checksum();
+        file_queue.clear();
+    } else if (file_size > DISK_READ_CHUNK - payload_queued) {
+        empty_references();
+
+        // Holes of sparse files are not read but passed to the library as zeros that it emits as fill packets
+        uint64_t data_end = input_file != UNITXT("-stdin") && io.sparse(ifile) ? 0 : file_size;
 
         while (file_read < file_size) {
             statusbar.update(BACKUP, dup_counter_payload(), io.write_count, input_file);
-            size_t r = io.read_valid_length(in, minimum(file_size - file_read, DISK_READ_CHUNK), ifile, input_file);
-            if (input_file == UNITXT("-stdin") && r == 0) {
+
+            if (file_read == data_end) {
+                uint64_t hole = io.seek_hole(ifile, file_read, file_size, true) - file_read;
+                data_end = io.seek_hole(ifile, file_read + hole, file_size, false);
+                if (data_end <= file_read) {
+                    data_end = file_size;
+                }
+                if (hole > 0) {
+                    file_read += hole;
+                    payload_read += hole;
+                    checksum_zeros(hole, &file_meta.ct);
+                    static const unsigned char zeros[64 * K] = {};
+                    for (uint64_t z = 0; whole && z < hole; z += sizeof(zeros)) {
+                        dup_hash_update(whole, zeros, minimum(hole - z, sizeof(zeros)));
+                    }
+                    io.seek(ifile, file_read, SEEK_SET);
+                    write_checksum();
+                    uint64_t pay;
+                    size_t cc = dup_compress_hole(hole, out, &pay);
+                    write_packets(cc, pay);
+                    continue;
+                }
+            }
+
+            size_t r = read_chunk(payload_queue, minimum(data_end - file_read, DISK_READ_CHUNK));
+            if (r == 0) {
+                // End of -stdin, or the file has shrunk since it was sized
                 break;
             }
             file_read += r;
             payload_read += r;
-            checksum(in, r, &file_meta.ct);
-            payload_queue += string((char *)in, r);
-
-            if (file_read == file_size && file_size > 0) {
-                // No CRC block for 0-sized files
-                io.try_write("C", 1, ofile);
-                file_meta.checksum = file_meta.ct.result;
-                io.write_ui<uint64_t>(file_meta.ct.result, ofile);
+            if (whole) {
+                dup_hash_update(whole, payload_queue, r);
             }
+            payload_queued = r;
+
+            write_checksum();
             empty_q();
         }
         file_queue.clear();
     } else {
-        assert(file_size <= DISK_READ_CHUNK - payload_queue.size());
-        size_t r = io.read_valid_length(in, file_size, ifile, input_file);
+        assert(file_size <= DISK_READ_CHUNK - payload_queued);
+        if (reference_size > 0) {
+            empty_references();
+        }
+        unsigned char *dst = payload_queue + payload_queued;
+        size_t r = prefetched ? file_size : read_chunk(dst, file_size);
+        if (prefetched) {
+            checksum_combine(&file_meta.ct, &prefetched_part);
+        }
         file_read += r;
         payload_read += r;
-        checksum(in, r, &file_meta.ct);
-        assert(file_read == file_size);
-        if (file_read == file_size && file_size > 0) {
-            // No CRC block for 0-sized files
-            io.try_write("C", 1, ofile);
-            file_meta.checksum = file_meta.ct.result;
-            io.write_ui<uint64_t>(file_meta.ct.result, ofile);
+        if (whole) {
+            dup_hash_update(whole, dst, r);
         }
-        payload_queue += string((char *)in, r);
+        write_checksum();
+        payload_queued += r;
     }
 
-    fclose(ifile);
+    if (ifile) {
+        fclose(ifile);
+    }
 
     if (flush) {
-        empty_q();
+        empty_references();
 
         while (payload_compressed < payload_read) {
             size_t pay;
             size_t cc = flush_pend((char *)out, &pay);
-            payload_compressed += pay;
-            if (cc > 0) {
-                io.try_write("A", 1, ofile);
-                add_references(out, cc, io.write_count);
-                io.try_write(out, cc, ofile);
-                io.try_write("B", 1, ofile);
-            }
+            write_packets(cc, pay);
         }
     }
 
-    if (input_file == UNITXT("-stdin")) {
+    if (file_read < file_size) {
+        if (input_file != UNITXT("-stdin")) {
+            statusbar.print(2, UNITXT("File shrank while being read, stored the first %s bytes: %s"), del(file_read).c_str(), input_file.c_str());
+        }
         file_meta.size = file_read;
     }
     file_meta.checksum = file_meta.ct.result;
     contents.push_back(file_meta);
 }
 
-bool lua_test(STRING path, const STRING &script) {
+// Uses the metadata that the walk already has, and only stat's for the date of entries that the walk didn't stat
+bool lua_test(STRING path, const walk_entry_t &e, const STRING &script) {
     if (script == UNITXT("")) {
         return true;
     }
@@ -1672,27 +2702,16 @@ bool lua_test(STRING path, const STRING &script) {
     uint64_t size = 0;
     STRING ext = UNITXT("");
     STRING name = UNITXT("");
-    uint32_t attrib = 0;
-    tm date;
+    tm date = e.date;
 
-#ifdef WINDOWS
-    HANDLE hFind;
-    WIN32_FIND_DATAW data;
-    hFind = FindFirstFileW(path.c_str(), &data);
-    attrib = data.dwFileAttributes;
-
-    if (hFind != INVALID_HANDLE_VALUE) {
-        FindClose(hFind);
+    if (date.tm_year == 0) {
+        get_date(path, &date);
     }
 
-#endif
-
-    get_date(path, &date);
-
     path = remove_delimitor(path);
     name = right(remove_delimitor(path)) == UNITXT("") ? path : right(remove_delimitor(path));
 
-    if (is_dir(path)) {
+    if (ISDIR(e.attributes)) {
         dir = path;
     } else {
         size_t t = name.find_last_of(UNITXT("."));
@@ -1703,24 +2722,48 @@ bool lua_test(STRING path, const STRING &script) {
         }
 
         file = path;
-        size = filesize(path, follow_symlinks);
+        size = e.size;
     }
-    return execute(script, dir, file, name, size, ext, attrib, &date);
+    return execute(script, dir, file, name, size, ext, e.attributes, &date);
 }
 
-bool include(const STRING &name) {
-    STRING n = remove_delimitor(CASESENSE(unsnap(abs_path(name))));
+bool excluded(const STRING &path) {
+    if (exclude_paths.empty() && exclude_patterns.empty()) {
+        return false;
+    }
+
+    STRING n;
+    if (!follow_symlinks && path.starts_with(exclude_base)) {
+        // abs_path() only resolves symlinks in the parent, and the walk doesn't descend into any below base_dir
+        n = remove_delimitor(exclude_root + CASESENSE(path.substr(exclude_base.size())));
+    } else {
+        n = remove_delimitor(CASESENSE(unsnap(abs_path(path))));
+    }
 
-    for (uint32_t j = 0; j < excludelist.size(); j++) {
-        STRING e = excludelist[j];
-        if (n == e) {
-            // statusbar.print(9, UNITXT("Skipped, in -- exclude list: %s"),
-            // name.c_str());
-            return false;
+    if (exclude_paths.contains(n)) {
+        return true;
+    }
+    size_t depth = std::count(n.begin(), n.end(), DELIM_CHAR);
+    if (depth < exclude_patterns.size()) {
+        for (auto &p : exclude_patterns[depth]) {
+            if (wildcard_match(p, n)) {
+                return true;
+            }
         }
     }
+    return false;
+}
 
-    if (!lua_test(name, lua)) {
+// Also called by the Walker threads for the sub directories that they would list ahead
+bool include(const STRING &name, const walk_entry_t &e) {
+    if (excluded(name)) {
+        // statusbar.print(9, UNITXT("Skipped, in -- exclude list: %s"),
+        // name.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(lua_mutex);
+    if (!lua_test(name, e, lua)) {
         // statusbar.print(9, UNITXT("Skipped, by -f filter: %s"), name.c_str());
         return false;
     }
@@ -1735,18 +2778,27 @@ void fail_list_dir(const STRING &dir) {
     }
 }
 
-void compress(const STRING &base_dir, vector<STRING> items) {
+// we must avoid including destination file when compressing. Comparing device and inode numbers from the walk spares
+// the abs_path() calls and also catches the archive when reached through another path
+#ifdef WINDOWS
+bool is_output_file(const STRING &path, const walk_entry_t &) { return CASESENSE(abs_path(path)) == CASESENSE(abs_path(output_file)); }
+#else
+uint64_t output_dev = 0;
+uint64_t output_ino = 0;
+bool is_output_file(const STRING &, const walk_entry_t &e) { return output_ino != 0 && e.ino == output_ino && e.dev == output_dev; }
+#endif
+
+void compress(const STRING &base_dir, vector<walk_entry_t> items, Walker &walker, ReadAhead *reader) {
     // Todo, simplify this function by initially creating three distinct lists
     // for files, dirs and symlinks. Instead of iterating through the same list
     // with each their if-conditions
 
-    vector<int> attributes;
-    vector<STRING> root_items;
-    vector<STRING> non_root_items;
+    vector<walk_entry_t> root_items;
+    vector<walk_entry_t> non_root_items;
 
     // Sort input items so that root items are first.
     for (uint32_t i = 0; i < items.size(); i++) {
-        if (items[i].find(DELIM_STR) == string::npos) {
+        if (items[i].name.find(DELIM_STR) == string::npos) {
             root_items.push_back(items[i]);
         } else {
             non_root_items.push_back(items[i]);
@@ -1756,133 +2808,154 @@ void compress(const STRING &base_dir, vector<STRING> items) {
     items.insert(items.end(), root_items.begin(), root_items.end());
     items.insert(items.end(), non_root_items.begin(), non_root_items.end());
 
-    // Put item types (file, dir, symlink) in items_type[]
     // Todo, beautify by just deleting entries in 'items' instead of building an
     // 'items2'
-    vector<STRING> items2;
+    vector<walk_entry_t> items2;
     for (uint32_t i = 0; i < items.size(); i++) {
-        STRING sub = base_dir + items[i];
-        int type = get_attributes(sub, follow_symlinks);
-        if (type == -1) {
+        STRING sub = base_dir + items[i].name;
+        if (items[i].attributes == -1) {
             if (continue_flag) {
                 statusbar.print(2, UNITXT("Skipped, access error: %s"), sub.c_str());
             } else {
                 abort(true, UNITXT("Aborted, access error: %s"), sub.c_str());
             }
-        } else {
-            // we must avoid including destination file when compressing. Note
-            // that *nix is case sensitive.
-            if (CASESENSE(abs_path(sub)) != CASESENSE(abs_path(output_file))) {
-                items2.push_back(items[i]);
-                attributes.push_back(type);
-            }
+        } else if (!is_output_file(sub, items[i])) {
+            items2.push_back(items[i]);
+        }
+    }
+    items.swap(items2);
+
+    // first process files. They are all handed to the read-ahead threads before the first one is compressed
+    vector<bool> selected(items.size());
+    vector<const contents_t *> unchanged(items.size());
+    vector<bool> linked(items.size());
+    for (uint32_t j = 0; j < items.size(); j++) {
+        int attributes = items[j].attributes;
+        const STRING &name = items[j].name;
+        STRING sub = base_dir + name;
+        selected[j] = !ISDIR(attributes) && !(ISLINK(attributes) && !follow_symlinks) && include(sub, items[j]);
+        if (selected[j] && quick_flag && !ISNAMEDPIPE(attributes)) {
+            STRING full;
+            STRING dir = directory_name(base_dir, left(name) + (left(name) == UNITXT("") ? UNITXT("") : DELIM_STR), full);
+            unchanged[j] = unchanged_file(sub, dir, right(name) == UNITXT("") ? name : right(name), items[j]);
+        }
+        if (selected[j] && !unchanged[j] && items[j].links > 1 && items[j].size > 0 && !ISNAMEDPIPE(attributes)) {
+            // Only the first link is read, also when it's later in this same directory listing
+            linked[j] = !hard_links.try_emplace({items[j].dev, items[j].ino}).second;
+        }
+        if (selected[j] && reader && items[j].size > 0 && !ISNAMEDPIPE(attributes) && !unchanged[j] && !linked[j]) {
+            reader->add(sub, items[j].size);
         }
     }
-    items.clear();
-    items.insert(items.end(), items2.begin(), items2.end());
 
-    // first process files
     for (uint32_t j = 0; j < items.size(); j++) {
         STRING thisone;
         STRING nextone;
-        STRING sub = base_dir + items[j];
-        if (!ISDIR(attributes[j]) && !(ISLINK(attributes[j]) && !follow_symlinks) && include(sub)) {
-            save_directory(base_dir, left(items[j]) + (left(items[j]) == UNITXT("") ? UNITXT("") : DELIM_STR), true);
+        const STRING &name = items[j].name;
+        STRING sub = base_dir + name;
+        if (selected[j]) {
+            STRING dir = left(name) + (left(name) == UNITXT("") ? UNITXT("") : DELIM_STR);
+            save_directory(base_dir, dir, true);
 
             bool last = (j == items.size() - 1);
 
             bool newdir = false;
             if (items.size() > j + 1) {
-                thisone = left(items[j]) + (left(items[j]) == UNITXT("") ? UNITXT("") : DELIM_STR);
-                nextone = left(items[j + 1]) + (left(items[j + 1]) == UNITXT("") ? UNITXT("") : DELIM_STR);
+                const STRING &next = items[j + 1].name;
+                thisone = left(name) + (left(name) == UNITXT("") ? UNITXT("") : DELIM_STR);
+                nextone = left(next) + (left(next) == UNITXT("") ? UNITXT("") : DELIM_STR);
                 if (thisone != nextone) {
                     newdir = true;
                 }
-                if (ISDIR(attributes[j + 1])) {
+                if (ISDIR(items[j + 1].attributes)) {
                     newdir = true;
                 }
             }
 
             bool flush = newdir || last;
 
-            STRING u = items[j];
-            STRING s = right(u) == UNITXT("") ? u : right(u);
-            compress_file(sub, s, flush);
+            STRING s = right(name) == UNITXT("") ? name : right(name);
+            const contents_t *same = unchanged[j];
+            std::pair<uint64_t, uint64_t> inode = {items[j].dev, items[j].ino};
+            if (linked[j]) {
+                // Read after all if the first link failed to open or has changed size since
+                const contents_t &first = hard_links[inode];
+                same = first.link != UNITXT("") && first.size == items[j].size ? &first : nullptr;
+            }
+
+            dup_hash *whole = nullptr;
+            std::pair<uint64_t, uint64_t> key;
+            if (whole_flag && !same && items[j].size >= WHOLE_MIN && !ISNAMEDPIPE(items[j].attributes) && whole_key(sub, items[j].size, key)) {
+                same = whole_duplicate(sub, items[j].size, key, reader);
+                whole = same ? nullptr : dup_hash_create();
+            }
+
+            size_t n = contents.size();
+            compress_file(sub, s, flush, &items[j], reader, same, whole);
+
+            if (whole) {
+                whole_file_t w;
+                dup_hash_digest(whole, w.hash);
+                if (contents.size() > n && contents.back().size == items[j].size) {
+                    w.c = contents.back();
+                    w.c.payload += chain_payload;
+                    whole_files[key].push_back(w);
+                }
+            }
+
+            if (items[j].links > 1 && !linked[j] && contents.size() > n && hard_links.contains(inode)) {
+                STRING full;
+                contents_t &first = hard_links[inode];
+                first = contents.back();
+                first.payload += chain_payload;
+                first.link = contents_key(directory_name(base_dir, dir, full), s);
+            }
         }
     }
 
     // then process symlinks
     for (uint32_t j = 0; j < items.size(); j++) {
-        STRING sub = base_dir + items[j];
-
-        if (ISLINK(attributes[j]) && !follow_symlinks && include(sub)) {
+        const STRING &name = items[j].name;
+        STRING sub = base_dir + name;
 
-            // we must avoid including destination file when compressing. Note
-            // that *nix is case sensitive.
-            if (output_file == UNITXT("-stdout") || (CASESENSE(abs_path(sub)) != CASESENSE(abs_path(output_file)))) {
+        if (ISLINK(items[j].attributes) && !follow_symlinks && include(sub, items[j])) {
 #ifdef WINDOWS
-                statusbar.print(2, UNITXT("Skipped, symlinks not supported on Windows: %s"), sub.c_str());
+            statusbar.print(2, UNITXT("Skipped, symlinks not supported on Windows: %s"), sub.c_str());
 #else
-                save_directory(base_dir, left(items[j]) + (left(items[j]) == UNITXT("") ? UNITXT("") : DELIM_STR), true);
-                compress_symlink(sub, right(items[j]) == UNITXT("") ? items[j] : right(items[j]));
+            save_directory(base_dir, left(name) + (left(name) == UNITXT("") ? UNITXT("") : DELIM_STR), true);
+            compress_symlink(sub, right(name) == UNITXT("") ? name : right(name));
 #endif
-            }
         }
     }
 
     // finally process directories
     for (uint32_t j = 0; j < items.size(); j++) {
-        STRING sub = base_dir + items[j];
-        if (ISDIR(attributes[j]) && recursive_flag && include(sub)) {
-            if (items[j] != UNITXT("")) {
-                items[j] = remove_delimitor(items[j]) + DELIM_STR;
+        STRING sub = base_dir + items[j].name;
+        if (ISDIR(items[j].attributes) && recursive_flag && include(sub, items[j])) {
+            STRING dir = items[j].name;
+            if (dir != UNITXT("")) {
+                dir = remove_delimitor(dir) + DELIM_STR;
             }
 
-            vector<STRING> newdirs;
 #ifdef WINDOWS
-            if (ISLINK(attributes[j])) {
+            if (ISLINK(items[j].attributes)) {
                 continue;
             }
-
-            HANDLE hFind;
-            BOOL bContinue = TRUE;
-            WIN32_FIND_DATAW data;
-            STRING s = remove_delimitor(sub) + UNITXT("\\*");
-            hFind = FindFirstFileW(s.c_str(), &data);
-            bContinue = hFind != INVALID_HANDLE_VALUE;
-
-            if (hFind == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_NOT_FOUND) {
+#endif
+            vector<walk_entry_t> newdirs;
+            if (!walker.list(sub, newdirs)) {
                 fail_list_dir(sub);
-            } else {
-                while (bContinue) {
-                    if (STRING(data.cFileName) != UNITXT(".") && STRING(data.cFileName) != UNITXT("..")) {
-                        newdirs.push_back(items[j] + STRING(data.cFileName));
-                    }
-                    bContinue = FindNextFileW(hFind, &data);
-                }
-                FindClose(hFind);
+                newdirs.clear();
             }
-#else
-            struct dirent *entry;
-            DIR *dir = opendir(sub.c_str());
-
-            if (dir == 0) {
-                fail_list_dir(sub);
-            } else {
-                while ((entry = readdir(dir)) != 0) {
-                    if (STRING(entry->d_name) != UNITXT(".") && STRING(entry->d_name) != UNITXT("..")) {
-                        newdirs.push_back(items[j] + entry->d_name);
-                    }
-                }
+            for (auto &e : newdirs) {
+                e.name = dir + e.name;
             }
 
-            closedir(dir);
-#endif
-            if (items[j] != UNITXT("")) {
+            if (dir != UNITXT("")) {
                 dirs++;
             }
-            save_directory(base_dir, items[j], true);
-            compress(base_dir, newdirs);
+            save_directory(base_dir, dir, true);
+            compress(base_dir, newdirs, walker, reader);
         }
     }
 }
@@ -1905,14 +2978,33 @@ void compress_args(vector<STRING> args) {
     }
     statusbar.m_base_dir = base_dir;
 
+#ifndef WINDOWS
+    struct stat s;
+    if (fstat(fileno(ofile), &s) == 0) {
+        output_dev = s.st_dev;
+        output_ino = s.st_ino;
+    }
+#endif
+
+    exclude_base = base_dir;
+    exclude_root = remove_delimitor(CASESENSE(unsnap(abs_path(base_dir == UNITXT("") ? UNITXT(".") : base_dir)))) + DELIM_STR;
+
+    Walker walker(threads, 4096, follow_symlinks, recursive_flag, [](const STRING &path, const walk_entry_t &e) { return !include(path, e); });
+    vector<walk_entry_t> items;
     for (i = 0; i < args.size(); i++) {
-        args[i] = args[i].substr(base_dir.length());
+        walk_entry_t e;
+        walker.stat_path(args[i], e);
+        e.name = args[i].substr(base_dir.length());
+        items.push_back(e);
     }
-    compress(base_dir, args);
+    ReadAhead reader(readahead_mb > 0 ? threads : 0, readahead_mb * M, DISK_READ_CHUNK, cache_flag);
+    compress(base_dir, items, walker, readahead_mb > 0 ? &reader : nullptr);
 }
 
 void decompress_sequential(const STRING &extract_dir, bool add_files) {
     STRING curdir;
+    STRING archive_dir;
+    std::unordered_map<STRING, STRING> restored; // by path in the archive, for the later hard links to them
     size_t r = 0;
     STRING base_dir = abs_path(extract_dir);
     statusbar.m_base_dir = base_dir;
@@ -1931,6 +3023,7 @@ void decompress_sequential(const STRING &extract_dir, bool add_files) {
             contents_t c;
             read_content_item(ifile, &c);
             ensure_relative(c.name);
+            archive_dir = c.name;
             curdir = extract_dir + DELIM_STR + c.name;
             save_directory(UNITXT(""), curdir);
             create_directories(curdir);
@@ -1945,6 +3038,11 @@ void decompress_sequential(const STRING &extract_dir, bool add_files) {
                 files++;
                 io.close(h);
             } else {
+                // A hard link to a file that was restored before is linked to it instead of written. Its data is still
+                // decompressed because the archive can't be skipped through
+                auto target = restored.find(c.link);
+                c.link = c.link != UNITXT("") && target != restored.end() ? target->second : UNITXT("");
+                restored[contents_key(archive_dir, c.name)] = buf2;
                 c.extra = buf2;
                 c.checksum = 0;
                 file_queue.push_back(c);
@@ -1969,6 +3067,7 @@ void decompress_sequential(const STRING &extract_dir, bool add_files) {
         }
 
         else if (w == 'X') {
+            close_infiles();
             return;
         } else {
             abort(true, UNITXT("Source file corrupted"));
@@ -1976,6 +3075,20 @@ void decompress_sequential(const STRING &extract_dir, bool add_files) {
     }
 }
 
+// dup_table_alloc() that tells at -v3 how the table was placed, such as when explicit huge pages weren't available
+void *alloc_table(uint64_t mem) {
+    int placement = 0;
+    void *t = dup_table_alloc(mem, interleave_flag, &placement);
+    if (t) {
+        statusbar.print(3, UNITXT("Hash table of %s on %s%s"), s2w(format_size(mem)).c_str(),
+                        placement & DUP_TABLE_HUGETLB ? UNITXT("huge pages")
+                        : placement & DUP_TABLE_THP   ? UNITXT("transparent huge pages")
+                                                      : UNITXT("normal pages"),
+                        placement & DUP_TABLE_INTERLEAVED ? UNITXT(", interleaved across NUMA nodes") : UNITXT(""));
+    }
+    return t;
+}
+
 uint32_t max_bits(uint64_t max_memory) {
     int n = 0;
     while (dup_memory(n) <= max_memory) {
@@ -1984,7 +3097,7 @@ uint32_t max_bits(uint64_t max_memory) {
     return n - 1;
 }
 
-void write_header(FILE *file, status_t s, uint64_t mem, bool hash_flag, uint64_t hash_salt) {
+void write_header(FILE *file, status_t s, uint64_t mem, bool hash_flag, bool compact_flag, uint64_t hash_salt) {
     if (s == BACKUP) {
         io.try_write("EXDUPE F", 8, file);
     } else if (s == DIFF_BACKUP) {
@@ -2001,6 +3114,7 @@ void write_header(FILE *file, status_t s, uint64_t mem, bool hash_flag, uint64_t
     io.write_ui<uint64_t>(DEDUPE_LARGE, file);
 
     io.write_ui<uint8_t>(hash_flag ? 1 : 0, file);
+    io.write_ui<uint8_t>(compact_flag ? 1 : 0, file);
     io.write_ui<uint64_t>(hash_salt, file);
 
     io.write_ui<uint64_t>(mem, file);
@@ -2034,6 +3148,7 @@ uint64_t read_header(FILE *file, STRING filename, status_t expected) {
           filename.c_str(), major, minor, revision, major);
 
     hash_flag = io.read_ui<uint8_t>(file) == 1;
+    compact_flag = io.read_ui<uint8_t>(file) == 1;
     hash_salt = io.read_ui<uint64_t>(file);
     return io.read_ui<uint64_t>(file); // mem usage
 }
@@ -2081,10 +3196,12 @@ int main(int argc2, char *argv2[])
     if (restore_flag || compress_flag || list_flag) {
         in = static_cast<unsigned char *>(tmalloc(DISK_READ_CHUNK + M));
         out = static_cast<unsigned char *>(tmalloc((threads + 1) * DISK_READ_CHUNK + M)); // todo, compute exact to save memory
+        payload_queue = static_cast<unsigned char *>(tmalloc(DISK_READ_CHUNK));
     }
 
     if (restore_flag) {
-        buffer_init(RESTORE_BUFFER);
+        buffer_init(megabyte_flag != 0 || gigabyte_flag != 0 ? memory_usage : RESTORE_BUFFER);
+        window_init(megabyte_flag != 0 || gigabyte_flag != 0 ? memory_usage : RESTORE_BUFFER);
     }
 
     if (list_flag) {
@@ -2093,17 +3210,14 @@ int main(int argc2, char *argv2[])
     } else if (restore_flag && full != UNITXT("-stdin") && diff != UNITXT("-stdin")) {
         // Restore from file.
         // =================================================================================================
-        if (diff_flag) {
-            FILE *fdiff = try_open(diff, 'r', true);
-            FILE *ffull = try_open(full, 'r', true);
-            read_header(ffull, full, BACKUP);
-            read_header(fdiff, diff, DIFF_BACKUP);
-            decompress_individuals(ffull, fdiff);
-        } else {
-            ifile = try_open(full, 'r', true);
-            read_header(ifile, full, BACKUP);
-            decompress_individuals(ifile, ifile);
+        ifile = try_open(full, 'r', true);
+        read_header(ifile, full, BACKUP);
+        vector<FILE *> archives = {ifile};
+        for (auto &d : diffs) {
+            archives.push_back(try_open(d, 'r', true));
+            read_header(archives.back(), d, DIFF_BACKUP);
         }
+        decompress_individuals(archives);
         wrote_message(tot_res, files);
     } else if ((restore_flag && (full == UNITXT("-stdin"))) && restorelist.size() == 0) {
         // Restore from stdin. Only entire archive can be restored this way
@@ -2124,15 +3238,23 @@ int main(int argc2, char *argv2[])
         if (diff_flag) {
             output_file = diff;
             ofile = open_destination(output_file);
+            io.attach_writer(ofile, cache_flag);
+            uint64_t overlay_usage = megabyte_flag != 0 || gigabyte_flag != 0 ? memory_usage : 0;
+
+            // An incremental backup is based on the last archive of its chain, which holds the hash table of all of it
             ifile = try_open(full, 'r', true);
-            memory_usage = read_header(ifile, full, BACKUP); // also inits hash_salt
-            hashtable = malloc(memory_usage);
-            memset(hashtable, 0, memory_usage);
+            bool base_diff = incremental_flag && is_diff_archive(full);
+            memory_usage = read_header(ifile, full, base_diff ? DIFF_BACKUP : BACKUP); // also inits hash_salt
+            abort(base_diff && find_section(ifile, "HASHTBLE", false).name == "",
+                  UNITXT("'%s' is not an incremental backup. Base it on the .full file or a .diff file made with -I"), slashify(full).c_str());
+            uint64_t base = base_diff ? read_diff_base(ifile) : 0;
+            chain_payload = base + archive_payload(ifile);
+            hashtable = alloc_table(memory_usage);
             abort(!hashtable,
                   UNITXT("Out of memory. This differential backup requires %d "
                          "MB. Try -t1 flag"),
                   dup_memory(bits) >> 20);
-            int r = dup_init(DEDUPE_LARGE, DEDUPE_SMALL, memory_usage, threads, hashtable, compression_level, hash_flag, hash_salt);
+            int r = dup_init(DEDUPE_LARGE, DEDUPE_SMALL, memory_usage, threads, hashtable, compression_level, hash_flag, hash_salt, compact_flag);
             abort(r == 1,
                   UNITXT("Out of memory. This differential backup requires %d "
                          "MB. Try -t1 flag"),
@@ -2142,23 +3264,36 @@ int main(int argc2, char *argv2[])
                          "requires %d MB memory. Try -t1 flag"),
                   dup_memory(bits) >> 20);
             read_hashtable(ifile);
+            if (quick_flag) {
+                load_full_contents(ifile, base);
+            }
+            footers.erase(ifile);
             io.close(ifile);
-            dup_add(false);
+            dup_add(incremental_flag);
+            dup_set_payload(chain_payload);
+            if (overlay_usage > 0) {
+                overlaytable = alloc_table(overlay_usage);
+                abort(!overlaytable, UNITXT("Out of memory. Reduce -m or -g flag"));
+                overlay_memory = overlay_usage;
+                dup_overlay(overlaytable, overlay_usage);
+            }
+            pay_count = chain_payload;
 
         } else {
             output_file = full;
             ofile = open_destination(output_file);
+            io.attach_writer(ofile, cache_flag);
             hash_salt = rnd64();
-            hashtable = tmalloc(memory_usage);
+            hashtable = alloc_table(memory_usage);
             abort(!hashtable, UNITXT("Out of memory. Reduce -m, -g or -t flag"));
-            int r = dup_init(DEDUPE_LARGE, DEDUPE_SMALL, memory_usage, threads, hashtable, compression_level, hash_flag, hash_salt);
+            int r = dup_init(DEDUPE_LARGE, DEDUPE_SMALL, memory_usage, threads, hashtable, compression_level, hash_flag, hash_salt, compact_flag);
             abort(r == 1, UNITXT("Out of memory. Reduce -m, -g or -t flag"));
             abort(r == 2, UNITXT("Error creating threads. Reduce -m, -g or -t flag"));
             dup_add(true);
         }
 
         output_file_mine = true; // todo, can this be deleted?
-        write_header(ofile, diff_flag ? DIFF_BACKUP : BACKUP, memory_usage, hash_flag, hash_salt);
+        write_header(ofile, diff_flag ? DIFF_BACKUP : BACKUP, memory_usage, hash_flag, compact_flag, hash_salt);
 
         if (inputfiles.size() > 0 && inputfiles[0] != UNITXT("-stdin")) {
             compress_args(inputfiles);
@@ -2177,15 +3312,17 @@ int main(int argc2, char *argv2[])
         io.try_write("X", 1, ofile);
 
         write_contents(ofile);
+        write_path_index(ofile);
 
-        if (!diff_flag) {
+        if (!diff_flag || incremental_flag) {
             write_hashtable(ofile);
-            write_references(ofile);
-        } else {
-            write_references(ofile);
+        }
+        write_references(ofile);
+        if (diff_flag) {
+            write_diff_base(ofile);
         }
 
-        io.try_write("END", 3, ofile);
+        write_footer(ofile);
 
         auto speed = s2w(format_size(dup_counter_payload() / (GetTickCount() - start_time) * 1000));
         auto sratio = ((float(io.write_count) / float(dup_counter_payload() + 0.01)) * 100.);
@@ -2197,6 +3334,9 @@ int main(int argc2, char *argv2[])
         // format_size(small_hits())"\n";
 
         io.close(ofile);
+        dup_deinit();
+        dup_table_free(hashtable, memory_usage);
+        dup_table_free(overlaytable, overlay_memory);
     } else {
         print_usage();
     }
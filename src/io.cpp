@@ -5,6 +5,8 @@
 // Copyrights:
 // 2010 - 2024: Lasse Mikkel Reinhold
 
+#include <cassert>
+#include <cerrno>
 #include <iostream>
 #include <time.h>
 
@@ -18,6 +20,9 @@
 #endif
 
 #ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #if defined(hpux) || defined(__hpux) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__FreeBSD__)
 #define _ftelli64 ftello
 #define _fseeki64 fseeko
@@ -44,7 +49,21 @@ bool Cio::stdin_tty() {
 #endif
 }
 
-int Cio::close(FILE *_File) { return fclose(_File); }
+int Cio::close(FILE *_File) {
+    if (writer && writer->file() == _File) {
+        bool ok = writer->finish();
+        delete writer;
+        writer = nullptr;
+        abort(!ok, UNITXT("Disk full or write denied while writing destination file"));
+    }
+    return fclose(_File);
+}
+
+// All following writes to _File go through an ArchiveWriter until it's closed with close()
+void Cio::attach_writer(FILE *_File, int cache_mode) {
+    assert(!writer);
+    writer = new ArchiveWriter(_File, cache_mode);
+}
 
 FILE *Cio::open(STRING file, char mode) {
     if (mode == 'r') {
@@ -79,6 +98,18 @@ size_t Cio::write(const void *_Str, size_t _Count, FILE *_File) {
 	}
 #endif
 
+    if (write_checksum) {
+        checksum(static_cast<unsigned char *>(const_cast<void *>(_Str)), _Count, write_checksum);
+    }
+
+    if (writer && writer->file() == _File) {
+        if (!writer->write(_Str, _Count)) {
+            return 0;
+        }
+        write_count += _Count;
+        return _Count;
+    }
+
     size_t w = fwrite(_Str, 1, _Count, _File);
     write_count += w;
     return w;
@@ -106,6 +137,150 @@ size_t Cio::try_read(void *DstBuf, size_t Count, FILE *_File) {
     return Count;
 }
 
+// Extends a file that is being written sequentially by Count zero bytes without writing them, so that the file
+// system can leave a hole. Returns false if the file cannot be extended this way, like if it's a pipe
+bool Cio::write_hole(uint64_t Count, FILE *_File) {
+    uint64_t end = tell(_File) + Count;
+    if (fflush(_File) != 0) {
+        return false;
+    }
+#ifdef WINDOWS
+    if (_chsize_s(_fileno(_File), end) != 0) {
+#else
+    if (ftruncate(fileno(_File), end) != 0) {
+#endif
+        return false;
+    }
+    return seek(_File, end, SEEK_SET) == 0;
+}
+
+// Size of the open file, or 0 if it can't be told, such as for pipes
+uint64_t Cio::size(FILE *_File) {
+#ifdef WINDOWS
+    __int64 s = _filelengthi64(_fileno(_File));
+    return s < 0 ? 0 : static_cast<uint64_t>(s);
+#else
+    struct stat s;
+    return fstat(fileno(_File), &s) == 0 && S_ISREG(s.st_mode) ? static_cast<uint64_t>(s.st_size) : 0;
+#endif
+}
+
+// True if the file has a hole before its end. Fewer allocated blocks than the size implies is only a hint, because
+// compressed file systems and inline data give the same, so the first hole is looked up to be sure
+bool Cio::sparse(FILE *_File) {
+#if defined(WINDOWS) || !defined(SEEK_DATA)
+    (void)_File;
+    return false;
+#else
+    struct stat s;
+    if (fstat(fileno(_File), &s) != 0 || !S_ISREG(s.st_mode) || static_cast<uint64_t>(s.st_blocks) * 512 >= static_cast<uint64_t>(s.st_size)) {
+        return false;
+    }
+    return seek_hole(_File, 0, s.st_size, false) < static_cast<uint64_t>(s.st_size);
+#endif
+}
+
+// Returns the start of the next data (Data = true) or hole (Data = false) at or after Offset, or Size if there is none.
+// The file position is left unchanged. Where holes cannot be enumerated, the whole file is reported as data
+uint64_t Cio::seek_hole(FILE *_File, uint64_t Offset, uint64_t Size, bool Data) {
+#if defined(WINDOWS) || !defined(SEEK_DATA)
+    (void)_File;
+    return Data ? Offset : Size;
+#else
+    uint64_t pos = tell(_File);
+    off_t r = lseek(fileno(_File), Offset, Data ? SEEK_DATA : SEEK_HOLE);
+    int err = errno;
+    seek(_File, pos, SEEK_SET);
+    if (r < 0) {
+        // ENXIO means there is no data after Offset. Any other error means no hole support
+        return Data && err != ENXIO ? Offset : Size;
+    }
+    return minimum(static_cast<uint64_t>(r), Size);
+#endif
+}
+
+// Memory suitable for O_DIRECT transfers
+unsigned char *Cio::alloc_aligned(size_t size) {
+#ifdef WINDOWS
+    return static_cast<unsigned char *>(_aligned_malloc(size, ALIGN));
+#else
+    void *p;
+    return posix_memalign(&p, ALIGN, size) == 0 ? static_cast<unsigned char *>(p) : nullptr;
+#endif
+}
+
+void Cio::free_aligned(unsigned char *block) {
+#ifdef WINDOWS
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+// Tells the kernel that a source file is read once from start to end. CACHE_DIRECT also bypasses the page cache for
+// read_at() where the file system allows it
+void Cio::cache_sequential(FILE *_File, int cache_mode) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (cache_mode != CACHE_NORMAL) {
+        posix_fadvise(fileno(_File), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+#ifdef O_DIRECT
+    if (cache_mode == CACHE_DIRECT) {
+        int flags = fcntl(fileno(_File), F_GETFL);
+        if (flags != -1) {
+            fcntl(fileno(_File), F_SETFL, flags | O_DIRECT);
+        }
+    }
+#else
+    (void)_File;
+    (void)cache_mode;
+#endif
+}
+
+// Evicts a range that has been read from the page cache
+void Cio::cache_drop(FILE *_File, uint64_t Offset, uint64_t Count) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fileno(_File), Offset, Count, POSIX_FADV_DONTNEED);
+#else
+    (void)_File;
+    (void)Offset;
+    (void)Count;
+#endif
+}
+
+// Positioned read that bypasses the FILE buffer, so it works with O_DIRECT when Offset, Count and DstBuf are aligned.
+// Falls back to buffered reading if the file system rejects O_DIRECT
+size_t Cio::read_at(FILE *_File, uint64_t Offset, void *DstBuf, size_t Count) {
+#ifdef WINDOWS
+    seek(_File, Offset, SEEK_SET);
+    return read(DstBuf, Count, _File);
+#else
+    int fd = fileno(_File);
+    size_t done = 0;
+    while (done < Count) {
+        ssize_t r = pread(fd, static_cast<char *>(DstBuf) + done, Count - done, Offset + done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+#ifdef O_DIRECT
+        if (r < 0 && errno == EINVAL) {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags != -1 && (flags & O_DIRECT) && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                continue;
+            }
+        }
+#endif
+        if (r <= 0) {
+            break;
+        }
+        done += r;
+    }
+    read_count += done;
+    return done;
+#endif
+}
+
 // Call if you have prior tested that the file is long enough that the read will not exceed it
 size_t Cio::read_valid_length(void *DstBuf, size_t Count, FILE *_File, STRING name) {
     size_t w = Cio::read((char *)DstBuf, Count, _File);
@@ -177,4 +352,178 @@ size_t Cio::writestr(STRING str, FILE *_File) {
     size_t r = write_ui<uint16_t>((unsigned int)t, _File);
     r += try_write(tmp2, t, _File);
     return r;
-}
\ No newline at end of file
+}
+ArchiveWriter::ArchiveWriter(FILE *file, int cache_mode) : m_file(file), m_cache_mode(cache_mode) {
+    fflush(m_file);
+#ifdef WINDOWS
+    m_preallocate = false;
+    m_regular = false;
+#else
+    int fd = fileno(m_file);
+    struct stat s;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    m_offset = pos < 0 ? 0 : pos;
+    m_allocated = m_offset;
+    m_dropped = m_offset;
+    m_regular = fstat(fd, &s) == 0 && S_ISREG(s.st_mode);
+    m_preallocate = m_regular;
+#ifdef O_DIRECT
+    if (cache_mode == CACHE_DIRECT && m_regular && m_offset % Cio::ALIGN == 0) {
+        int flags = fcntl(fd, F_GETFL);
+        m_direct = flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+    }
+#endif
+#endif
+
+    for (size_t i = 0; i < BLOCKS; i++) {
+        unsigned char *b = Cio::alloc_aligned(BLOCK);
+        abort(!b, UNITXT("Out of memory. Reduce -m, -g or -t flag"));
+        m_buffers.push_back(b);
+        m_free.push_back(b);
+    }
+    m_current = m_free.back();
+    m_free.pop_back();
+    m_thread = std::thread(&ArchiveWriter::worker, this);
+}
+
+ArchiveWriter::~ArchiveWriter() {
+    if (m_thread.joinable()) {
+        finish();
+    }
+    for (auto b : m_buffers) {
+        Cio::free_aligned(b);
+    }
+}
+
+// Returns false if an earlier block failed to be written
+bool ArchiveWriter::write(const void *src, size_t len) {
+    const unsigned char *p = static_cast<const unsigned char *>(src);
+    while (len > 0) {
+        size_t n = minimum(len, BLOCK - m_used);
+        memcpy(m_current + m_used, p, n);
+        m_used += n;
+        p += n;
+        len -= n;
+        if (m_used == BLOCK) {
+            submit();
+        }
+    }
+    return !m_failed;
+}
+
+void ArchiveWriter::submit() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_full.emplace_back(m_current, m_used);
+    m_cond.notify_all();
+    m_cond.wait(lock, [&] { return !m_free.empty(); });
+    m_current = m_free.back();
+    m_free.pop_back();
+    m_used = 0;
+}
+
+// Writes the last partial block and waits for the thread to complete. Returns false if any write failed
+bool ArchiveWriter::finish() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_used > 0) {
+            m_full.emplace_back(m_current, m_used);
+        } else {
+            m_free.push_back(m_current);
+        }
+        m_current = nullptr;
+        m_used = 0;
+        m_exit = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+
+#if !defined(WINDOWS) && defined(FALLOC_FL_KEEP_SIZE)
+    // Give back the extents that were reserved beyond the end
+    if (m_allocated > m_offset && ftruncate(fileno(m_file), m_offset) != 0) {
+        m_failed = true;
+    }
+#endif
+    return !m_failed;
+}
+
+void ArchiveWriter::worker() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_cond.wait(lock, [&] { return m_exit || !m_full.empty(); });
+        if (m_full.empty()) {
+            return;
+        }
+        auto [block, len] = m_full.front();
+        m_full.pop_front();
+
+        lock.unlock();
+        bool ok = !m_failed && write_block(block, len);
+        lock.lock();
+
+        m_failed = m_failed || !ok;
+        m_free.push_back(block);
+        m_cond.notify_all();
+    }
+}
+
+bool ArchiveWriter::write_block(const unsigned char *src, size_t len) {
+#ifdef WINDOWS
+    m_offset += len;
+    return fwrite(src, 1, len, m_file) == len;
+#else
+    int fd = fileno(m_file);
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    // Reserve extents ahead of the writes to reduce fragmentation. The file size is unaffected
+    if (m_preallocate && m_offset + len > m_allocated) {
+        m_preallocate = fallocate(fd, FALLOC_FL_KEEP_SIZE, m_allocated, PREALLOCATE) == 0;
+        m_allocated += PREALLOCATE;
+    }
+#endif
+
+#ifdef O_DIRECT
+    auto buffered = [&]() {
+        m_direct = false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    };
+    if (m_direct && len % Cio::ALIGN != 0) {
+        // Only the tail of the archive is not a whole number of aligned blocks
+        buffered();
+    }
+#endif
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = ::write(fd, src + done, len - done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+#ifdef O_DIRECT
+        if (w < 0 && errno == EINVAL && m_direct) {
+            // File system without O_DIRECT support
+            buffered();
+            continue;
+        }
+#endif
+        if (w <= 0) {
+            return false;
+        }
+        done += w;
+    }
+
+#ifdef POSIX_FADV_DONTNEED
+    if (m_cache_mode == CACHE_DROP && m_regular && m_offset > m_dropped) {
+        // Dirty pages can't be dropped, so start write back of this block and drop the ones before it once they're on
+        // disk. That wait is on this thread only
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(fd, m_offset, len, SYNC_FILE_RANGE_WRITE);
+        sync_file_range(fd, m_dropped, m_offset - m_dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+        posix_fadvise(fd, m_dropped, m_offset - m_dropped, POSIX_FADV_DONTNEED);
+        m_dropped = m_offset;
+    }
+#endif
+    m_offset += len;
+    return true;
+#endif
+}
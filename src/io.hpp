@@ -13,6 +13,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #ifdef WINDOWS
 #include <windows.h>
 #endif
@@ -22,19 +27,66 @@
 
 using namespace std;
 
+// Page cache policy for source files and the archive, set with the -d flag
+enum { CACHE_NORMAL, CACHE_DROP, CACHE_DIRECT };
+
+// Writes an archive from a background thread in large aligned blocks, so that deduplication doesn't wait for the disk
+// and metadata doesn't go out as many tiny writes. The destination is preallocated ahead of the write position where
+// the file system supports it. CACHE_DROP evicts written blocks from the page cache and CACHE_DIRECT bypasses it
+class ArchiveWriter {
+  public:
+    ArchiveWriter(FILE *file, int cache_mode);
+    ~ArchiveWriter();
+    bool write(const void *src, size_t len);
+    bool finish();
+    FILE *file() const { return m_file; }
+
+  private:
+    static const size_t BLOCK = 4 * 1024 * 1024;
+    static const size_t BLOCKS = 4;
+    static const uint64_t PREALLOCATE = 64 * 1024 * 1024;
+
+    void submit();
+    bool write_block(const unsigned char *src, size_t len);
+    void worker();
+
+    FILE *m_file;
+    int m_cache_mode;
+    bool m_regular = false;
+    bool m_direct = false;
+    bool m_preallocate = false;
+    uint64_t m_offset = 0;    // file offset of the next block to be written
+    uint64_t m_allocated = 0; // preallocated up to here
+    uint64_t m_dropped = 0;   // evicted from the page cache up to here
+    unsigned char *m_current = nullptr;
+    size_t m_used = 0;
+    vector<unsigned char *> m_buffers;
+    vector<unsigned char *> m_free;
+    std::deque<std::pair<unsigned char *, size_t>> m_full;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+    bool m_exit = false;
+    std::atomic<bool> m_failed = false;
+};
+
 class Cio {
   private:
     char tmp[4096];
     wchar_t wtmp[4096];
     CHR Ctmp[4096];
 
+    ArchiveWriter *writer = nullptr;
+
   public:
     uint64_t read_count;
     uint64_t write_count;
+    checksum_t *write_checksum = nullptr; // if set, bytes written are added to it
 
     Cio();
     //	void Cio::ahead(STRING file);
     int close(FILE *_File);
+    void attach_writer(FILE *_File, int cache_mode);
     FILE *open(STRING file, char mode);
     uint64_t tell(FILE *_File);
     int seek(FILE *_File, int64_t _Offset, int Origin);
@@ -44,6 +96,10 @@ class Cio {
     size_t write(const void *_Str, size_t _Count, FILE *_File);
     size_t try_write(const void *Str, size_t Count, FILE *_File);
     size_t try_read(void *DstBuf, size_t Count, FILE *_File);
+    bool write_hole(uint64_t Count, FILE *_File);
+    uint64_t size(FILE *_File);
+    bool sparse(FILE *_File);
+    uint64_t seek_hole(FILE *_File, uint64_t Offset, uint64_t Size, bool Data);
     size_t read_valid_length(void *DstBuf, size_t Count, FILE *_File, STRING name);
     STRING readstr(FILE *_File);
     size_t writestr(STRING str, FILE *_File);
@@ -75,5 +131,12 @@ class Cio {
 
     static bool stdin_tty();
 
+    static const size_t ALIGN = 4096;
+    static unsigned char *alloc_aligned(size_t size);
+    static void free_aligned(unsigned char *block);
+    void cache_sequential(FILE *_File, int cache_mode);
+    void cache_drop(FILE *_File, uint64_t Offset, uint64_t Count);
+    size_t read_at(FILE *_File, uint64_t Offset, void *DstBuf, size_t Count);
+
 };
 #endif
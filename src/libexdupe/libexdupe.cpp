@@ -24,6 +24,13 @@
 #define DUP_MAX_INPUT (32 * 1024 * 1024)
 #define DUP_MATCH "MM"
 #define DUP_LITERAL "TT"
+#define DUP_FILL "FF"
+
+// Runs of identical bytes (typically zeros in disk images and preallocated database files) of at least this length
+// bypass hashing and deduplication and are emitted as a single fill packet
+#define DUP_FILL_MIN (16 * 1024)
+// Largest run a single fill packet describes, as the length field is 32 bits
+#define DUP_MAX_FILL (1024 * 1024 * 1024ull)
 
 #if defined(__SVR4) && defined(__sun)
 #include <thread.h>
@@ -50,11 +57,19 @@
 #include <Windows.h>
 #else
 #include <pthread.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 #include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <iostream>
+#include <unordered_set>
 #include <vector>
 
 #include "blake3/c/blake3.h"
@@ -134,29 +149,6 @@ int pthread_mutex_trylock_wrapper(pthread_mutex_t *mutex) {
     return r;
 }
 
-// Todo, get rid of some of all these global variables
-size_t SMALL_BLOCK;
-size_t LARGE_BLOCK;
-uint64_t HASH_ENTRIES;
-int THREADS;
-int LEVEL;
-
-bool g_crypto_hash = false;
-uint64_t g_hash_salt = 0;
-
-// Unused. Todo, figure out if useful at all
-bool exit_threads;
-
-pthread_mutex_t table_mutex;
-pthread_cond_t jobdone_cond;
-pthread_mutex_t jobdone_mutex;
-mutex job_info;
-
-std::atomic<uint64_t> largehits = 0;
-std::atomic<uint64_t> smallhits = 0;
-
-// Set to false in order to not update the hashtable. Used during diff backup.
-bool add_data = true;
 
 #define SHA_SIZE 16
 
@@ -169,13 +161,95 @@ struct hash_t {
 };
 #pragma pack(pop)
 
-hash_t (*table)[2];
+// Compact 16-byte entry, selected by dup_init(). The offset is truncated to 48 bits (256 TB of payload) and only the
+// first COMPACT_SHA_SIZE bytes of the digest are kept. Together with the 16-bit tag this gives 64 bits to tell blocks
+// apart, so a false match needs two different blocks that fall into the same bucket, have the same tag and share 48
+// digest bits. Expect about one such undetected collision per 2^48 lookups that reach the digest compare, which is
+// still far below the rate of undetected disk errors, but is a real trade-off against the 128-bit digest
+#define COMPACT_SHA_SIZE 6
+#define COMPACT_MAX_OFFSET ((1ull << 48) - 1)
+
+struct compact_t {
+    uint64_t offset_slide; // offset in the lower 48 bits and slide in the upper 16
+    uint64_t tag_sha;      // tag in the lower 16 bits and the digest prefix in the upper 48
+};
+
+struct job_t;
+
+// State of one deduplication session. Sessions are independent of each other and only share the worker threads
+struct dup_ctx {
+    size_t small_block;
+    size_t large_block;
+    uint64_t hash_entries;
+    bool compact;
+    int threads;
+    int level;
+
+    bool crypto_hash;
+    uint64_t hash_salt;
+
+    pthread_mutex_t table_mutex;
+    pthread_cond_t jobdone_cond;
+    pthread_mutex_t jobdone_mutex;
+
+    std::atomic<uint64_t> largehits;
+    std::atomic<uint64_t> smallhits;
+
+    // Set to false in order to not update the hashtable. Used during diff backup.
+    bool add_data;
+
+    hash_t (*table)[2];
+    compact_t (*compact_table)[2];
+
+    // Writable table that payload is added to instead while add_data is false, layered on top of the read-only one. Used
+    // during diff backup, so that data that is new since the full is deduplicated against itself too
+    hash_t (*overlay)[2];
+    compact_t (*compact_overlay)[2];
+    uint64_t overlay_entries;
+
+    job_t *jobs;
+    char *zstd_decompress_state;
+
+    uint64_t flushed;
+    uint64_t global_payload;
+    uint64_t count_payload;
+    uint64_t count_compressed;
+};
 
 bool used(hash_t h) { return h.offset != 0 && h.hash != 0; }
 
-uint64_t large_hits() { return largehits; }
+INLINE static hash_t get_entry(dup_ctx *ctx, uint64_t j, int no, bool over = false) {
+    if (!ctx->compact) {
+        return over ? ctx->overlay[j][no] : ctx->table[j][no];
+    }
+    compact_t c = over ? ctx->compact_overlay[j][no] : ctx->compact_table[j][no];
+    hash_t h;
+    h.offset = c.offset_slide & COMPACT_MAX_OFFSET;
+    h.slide = static_cast<uint16_t>(c.offset_slide >> 48);
+    h.hash = static_cast<uint16_t>(c.tag_sha);
+    memset(h.sha, 0, SHA_SIZE);
+    for (int i = 0; i < COMPACT_SHA_SIZE; i++) {
+        h.sha[i] = static_cast<unsigned char>(c.tag_sha >> (16 + 8 * i));
+    }
+    return h;
+}
+
+INLINE static void set_entry(dup_ctx *ctx, uint64_t j, int no, const hash_t &h, bool over = false) {
+    if (!ctx->compact) {
+        (over ? ctx->overlay : ctx->table)[j][no] = h;
+        return;
+    }
+    compact_t c;
+    c.offset_slide = h.offset | (uint64_t(h.slide) << 48);
+    c.tag_sha = h.hash;
+    for (int i = 0; i < COMPACT_SHA_SIZE; i++) {
+        c.tag_sha |= uint64_t(h.sha[i]) << (16 + 8 * i);
+    }
+    (over ? ctx->compact_overlay : ctx->compact_table)[j][no] = c;
+}
 
-uint64_t small_hits() { return smallhits; }
+// Number of digest bytes that are stored and compared
+INLINE static size_t sha_size(dup_ctx *ctx) { return ctx->compact ? COMPACT_SHA_SIZE : SHA_SIZE; }
 
 template <class T, class U> const uint64_t minimum(const T a, const U b) {
     return (static_cast<uint64_t>(a) > static_cast<uint64_t>(b)) ? static_cast<uint64_t>(b) : static_cast<uint64_t>(a);
@@ -212,8 +286,31 @@ INLINE static uint64_t str2ll(const void *src, int bytes) {
     return l;
 }
 
-typedef struct {
-    pthread_t thread;
+// Returns the number of bytes at src, up to len, that are identical to src[0]
+INLINE static size_t run_length(const unsigned char *src, size_t len) {
+    size_t i = 0;
+    __m128i c = _mm_set1_epi8(static_cast<char>(src[0]));
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(&src[i]));
+        auto equal = _mm_movemask_epi8(_mm_cmpeq_epi8(v, c));
+        if (equal != 0xffff) {
+#if defined _MSC_VER
+            return i + _tzcnt_u32(static_cast<unsigned>(~equal));
+#else
+            return i + __builtin_ctz(static_cast<unsigned>(~equal));
+#endif
+        }
+    }
+
+    while (i < len && src[i] == src[0]) {
+        i++;
+    }
+    return i;
+}
+
+struct job_t {
+    dup_ctx *ctx;
     int status;
     unsigned char source[DUP_MAX_INPUT];
     unsigned char destination[DUP_MAX_INPUT + 1024 * 1024];
@@ -221,16 +318,12 @@ typedef struct {
     size_t size_source;
     size_t size_destination;
     pthread_mutex_t jobmutex;
-    pthread_cond_t cond;
     int id;
     char *zstd;
     bool add;
     bool busy;
-} job_t;
-
-job_t *jobs;
+};
 
-char *zstd_decompress_state;
 
 typedef struct {
     ZSTD_CCtx *cctx;
@@ -266,10 +359,10 @@ int64_t zstd_decompress(char *inbuf, size_t insize, char *outbuf, size_t outsize
     return ZSTD_decompressDCtx(zstd_params->dctx, outbuf, outsize, inbuf, insize);
 }
 
-INLINE static void sha(const unsigned char *src, size_t len, unsigned char *dst) {
-    if (g_crypto_hash) {
-        char salt[sizeof(g_hash_salt)];
-        ll2str(g_hash_salt, salt, sizeof(g_hash_salt));
+INLINE static void sha(dup_ctx *ctx, const unsigned char *src, size_t len, unsigned char *dst) {
+    if (ctx->crypto_hash) {
+        char salt[sizeof(ctx->hash_salt)];
+        ll2str(ctx->hash_salt, salt, sizeof(ctx->hash_salt));
         blake3_hasher hasher;
         blake3_hasher_init(&hasher);
         blake3_hasher_update(&hasher, salt, sizeof(salt));
@@ -278,7 +371,7 @@ INLINE static void sha(const unsigned char *src, size_t len, unsigned char *dst)
         blake3_hasher_finalize(&hasher, output, BLAKE3_OUT_LEN);
         memcpy(dst, output, SHA_SIZE);
     } else {
-        XXH64_hash_t s{g_hash_salt};
+        XXH64_hash_t s{ctx->hash_salt};
         XXH128_hash_t hash = XXH128(src, len, s);
         memcpy(dst, &hash, SHA_SIZE);
     }
@@ -316,30 +409,118 @@ INLINE static uint64_t shall(const void *src, size_t len) {
     return a_val + b_val;
 }
 
-void print_table() {
+void print_table(dup_ctx *ctx) {
     cerr << "\nbegin\n";
-    for (uint64_t i = 0; i < HASH_ENTRIES; i++) {
+    for (uint64_t i = 0; i < ctx->hash_entries; i++) {
         for (int j = 0; j < 2; j++) {
-            cerr << table[i][j].hash << "," << table[i][j].slide << "," << table[i][j].offset << "     ";
+            hash_t h = get_entry(ctx, i, j);
+            cerr << h.hash << "," << h.slide << "," << h.offset << "     ";
         }
         cerr << "\n";
     }
     cerr << "\nend\n";
 }
 
-size_t dup_compress_hashtable(void) {
-    // print_table();
+// A compact table cannot use the run-length format below in place, because the run headers of alternating used and
+// unused 16-byte entries take more space than they free. Instead, used entries are packed to the front, followed by a
+// bitmap of used slots that is built in the space that dup_init() reserved behind the table. The bitmap is stored
+// with zstd if that makes it smaller, which it nearly always does for tables that are not full
+static size_t compress_compact_hashtable(dup_ctx *ctx) {
+    uint64_t n = ctx->hash_entries * 2;
+    size_t map_size = (n + 7) / 8;
+    unsigned char *map = (unsigned char *)ctx->compact_table + n * sizeof(compact_t);
+    char *dst = (char *)ctx->compact_table;
+    memset(map, 0, map_size);
+
+    for (uint64_t i = 0; i < n; i++) {
+        compact_t c = ctx->compact_table[i / 2][i % 2];
+        if (used(get_entry(ctx, i / 2, i % 2))) {
+            map[i / 8] |= 1 << (i % 8);
+            ll2str(c.offset_slide, dst, 8);
+            ll2str(c.tag_sha, dst + 8, 8);
+            dst += sizeof(compact_t);
+        }
+    }
+
+    size_t bound = ZSTD_compressBound(map_size);
+    char *packed = (char *)malloc(bound);
+    size_t map_len = packed ? ZSTD_compress(packed, bound, map, map_size, 1) : map_size;
+    if (packed && !ZSTD_isError(map_len) && map_len < map_size) {
+        memcpy(dst, packed, map_len);
+    } else {
+        map_len = map_size;
+        memmove(dst, map, map_size);
+    }
+    free(packed);
+
+    dst += map_len;
+    ll2str(map_len, dst, 8);
+    dst += 8;
+    size_t siz = dst - (char *)ctx->compact_table;
+    ll2str(shall(ctx->compact_table, siz), dst, 8);
+    return siz + 8;
+}
+
+static int decompress_compact_hashtable(dup_ctx *ctx, size_t len) {
+    uint64_t n = ctx->hash_entries * 2;
+    size_t map_size = (n + 7) / 8;
+    unsigned char *src = (unsigned char *)ctx->compact_table;
+    if (len < 16 || str2ll(src + len - 8, 8) != shall(src, len - 8) || str2ll(src + len - 16, 8) > len - 16) {
+        fprintf(stderr, "\neXdupe: Internal error or archive corrupted, at table_expand(), at hashtable\n");
+        return -1;
+    }
+
+    size_t map_len = str2ll(src + len - 16, 8);
+    unsigned char *map = src + n * sizeof(compact_t);
+    unsigned char *map_src = src + len - 16 - map_len;
+    uint64_t k = (map_src - src) / sizeof(compact_t);
+
+    if (map_len == map_size) {
+        memmove(map, map_src, map_size);
+    } else {
+        // The packed bitmap may overlap its destination, so it's decompressed from a copy
+        unsigned char *packed = (unsigned char *)malloc(map_len);
+        size_t r = packed ? ZSTD_decompress(map, map_size, (char *)memcpy(packed, map_src, map_len), map_len) : 0;
+        free(packed);
+        if (!packed || ZSTD_isError(r) || r != map_size) {
+            fprintf(stderr, "\neXdupe: Internal error or archive corrupted, at table_expand(), at hashtable\n");
+            return -1;
+        }
+    }
+
+    // Expand backwards so that packed entries are read before their space is overwritten
+    for (uint64_t i = n; i-- > 0;) {
+        compact_t c = {0, 0};
+        if (map[i / 8] & (1 << (i % 8))) {
+            if (k == 0) {
+                fprintf(stderr, "\neXdupe: Internal error or archive corrupted, at table_expand(), at hashtable\n");
+                return -1;
+            }
+            k--;
+            c.offset_slide = str2ll(src + k * sizeof(compact_t), 8);
+            c.tag_sha = str2ll(src + k * sizeof(compact_t) + 8, 8);
+        }
+        ctx->compact_table[i / 2][i % 2] = c;
+    }
+    return 0;
+}
+
+size_t dup_compress_hashtable(dup_ctx *ctx) {
+    if (ctx->compact) {
+        return compress_compact_hashtable(ctx);
+    }
+    // print_table(ctx);
     uint64_t hash;
-    char *dst = (char *)table;
+    char *dst = (char *)ctx->table;
     uint64_t i = 0;
     size_t siz;
 
-    bool used2 = used(table[0][0]);
+    bool used2 = used(ctx->table[0][0]);
 
     do {
         uint64_t count = 1;
-        while (i + count < HASH_ENTRIES * 2) {
-            bool used3 = used(table[(i + count) / 2][(i + count) % 2]);
+        while (i + count < ctx->hash_entries * 2) {
+            bool used3 = used(ctx->table[(i + count) / 2][(i + count) % 2]);
             if (used2 != used3) {
                 break;
             }
@@ -349,7 +530,7 @@ size_t dup_compress_hashtable(void) {
         if (used2) {
             for (uint64_t k = 0; k < count; k++) {
                 hash_t h;
-                memcpy(&h, &table[i / 2][i % 2], sizeof(hash_t));
+                memcpy(&h, &ctx->table[i / 2][i % 2], sizeof(hash_t));
                 ll2str(h.offset, dst, 8);
                 ll2str(h.hash, dst + 8, 2);
                 ll2str(h.slide, dst + 8 + 2, 2);
@@ -365,22 +546,25 @@ size_t dup_compress_hashtable(void) {
         ll2str(count, dst, 8);
         dst += 8;
         used2 = !used2;
-    } while (i < HASH_ENTRIES * 2);
+    } while (i < ctx->hash_entries * 2);
 
-    siz = dst - (char *)table;
-    hash = shall(table, siz);
-    ll2str(hash, (char *)table + siz, 8);
+    siz = dst - (char *)ctx->table;
+    hash = shall(ctx->table, siz);
+    ll2str(hash, (char *)ctx->table + siz, 8);
     siz += 8;
 
     return siz;
 }
 
-int dup_decompress_hashtable(size_t len) {
-    unsigned char *src = (unsigned char *)table + len - 1;
-    size_t i = HASH_ENTRIES * 2 - 1;
+int dup_decompress_hashtable(dup_ctx *ctx, size_t len) {
+    if (ctx->compact) {
+        return decompress_compact_hashtable(ctx, len);
+    }
+    unsigned char *src = (unsigned char *)ctx->table + len - 1;
+    size_t i = ctx->hash_entries * 2 - 1;
 
     uint64_t hash = str2ll(src - 7, 8);
-    auto g = shall(table, src - (unsigned char *)table + 1 - 8);
+    auto g = shall(ctx->table, src - (unsigned char *)ctx->table + 1 - 8);
     if (hash != g) {
         // todo move error handing outside the lib
         fprintf(stderr, "\neXdupe: Internal error or archive corrupted, at table_expand(), at hashtable\n");
@@ -411,12 +595,12 @@ int dup_decompress_hashtable(size_t len) {
                 unsigned char temp[100];
                 src -= (8 + 2 + 2 + SHA_SIZE);
                 memcpy(temp, src, 8 + 2 + 2 + SHA_SIZE);
-                table[i / 2][i % 2].offset = str2ll(temp, 8);
-                table[i / 2][i % 2].hash = static_cast<uint16_t>(str2ll(temp + 8, 2));
-                table[i / 2][i % 2].slide = static_cast<uint16_t>(str2ll(temp + 8 + 2, 2));
-                memcpy(table[i / 2][i % 2].sha, temp + 8 + 2 + 2, SHA_SIZE);
+                ctx->table[i / 2][i % 2].offset = str2ll(temp, 8);
+                ctx->table[i / 2][i % 2].hash = static_cast<uint16_t>(str2ll(temp + 8, 2));
+                ctx->table[i / 2][i % 2].slide = static_cast<uint16_t>(str2ll(temp + 8 + 2, 2));
+                memcpy(ctx->table[i / 2][i % 2].sha, temp + 8 + 2 + 2, SHA_SIZE);
             } else {
-                memset(&table[i / 2][i % 2], 0, sizeof(hash_t));
+                memset(&ctx->table[i / 2][i % 2], 0, sizeof(hash_t));
             }
             if (i == 0) {
                 assert(k == count2 - 1);
@@ -428,11 +612,11 @@ int dup_decompress_hashtable(size_t len) {
         src -= 1; // used
     }
 
-    //    print_table();
+    //    print_table(ctx);
     return 0;
 }
 
-INLINE static uint64_t entry(uint64_t window) { return window % HASH_ENTRIES; }
+INLINE static uint64_t entry(dup_ctx *ctx, uint64_t window, bool over = false) { return window % (over ? ctx->overlay_entries : ctx->hash_entries); }
 
 INLINE static uint32_t quick(const unsigned char *src, size_t len) {
     uint32_t r1 = *reinterpret_cast<const uint8_t *>(src);
@@ -525,7 +709,7 @@ INLINE static uint32_t window(const unsigned char *src, size_t len, const unsign
 }
 
 // there must be LARGE_BLOCK more valid data after src + len
-INLINE const static unsigned char *dub(const unsigned char *src, uint64_t pay, size_t len, size_t block, int no, uint64_t *payload_ref) {
+INLINE const static unsigned char *dub(dup_ctx *ctx, const unsigned char *src, uint64_t pay, size_t len, size_t block, int no, uint64_t *payload_ref) {
     const unsigned char *w_pos;
     const unsigned char *orig_src = src;
     const unsigned char *last_src = src + len - 1;
@@ -533,58 +717,71 @@ INLINE const static unsigned char *dub(const unsigned char *src, uint64_t pay, s
     size_t collision_skip = 32;
 
     while (src <= last_src) {
-        uint64_t j = entry(w);
+        uint64_t j = entry(ctx, w);
 
         // CAUTION: Outside mutex, assume reading garbage and that data changes
         // between reads
-        if (table[j][no].hash == uint16_t(w) && used(table[j][no])) {
-            pthread_mutex_lock_wrapper(&table_mutex);
-            if (used(table[j][no]) && w_pos - table[j][no].slide > src && w_pos - table[j][no].slide <= last_src) {
-                src = w_pos - table[j][no].slide;
+        hash_t e = get_entry(ctx, j, no);
+
+        // The overlay is only looked up if the read-only table has no candidate. Its entries may be of payload that is
+        // still being processed, so they are subject to the same check as those of a writable table
+        bool over = false;
+        if (!(e.hash == uint16_t(w) && used(e)) && ctx->overlay_entries > 0) {
+            over = true;
+            j = entry(ctx, w, true);
+            e = get_entry(ctx, j, no, true);
+        }
+        bool committed = !ctx->add_data && !over;
+
+        if (e.hash == uint16_t(w) && used(e)) {
+            pthread_mutex_lock_wrapper(&ctx->table_mutex);
+            e = get_entry(ctx, j, no, over);
+            if (used(e) && w_pos - e.slide > src && w_pos - e.slide <= last_src) {
+                src = w_pos - e.slide;
             }
-            pthread_mutex_unlock_wrapper(&table_mutex);
+            pthread_mutex_unlock_wrapper(&ctx->table_mutex);
 
-            if (!add_data || (table[j][no].offset + block < pay + (src - orig_src))) {
+            if (committed || (e.offset + block < pay + (src - orig_src))) {
                 unsigned char s[SHA_SIZE];
 
-                if (block == LARGE_BLOCK) {
+                if (block == ctx->large_block) {
                     unsigned char tmp[8 * 1024];
-                    assert(sizeof(tmp) >= LARGE_BLOCK / SMALL_BLOCK * SHA_SIZE);
+                    assert(sizeof(tmp) >= ctx->large_block / ctx->small_block * SHA_SIZE);
                     uint32_t k;
-                    for (k = 0; k < LARGE_BLOCK / SMALL_BLOCK; k++) {
-                        sha(src + k * SMALL_BLOCK, SMALL_BLOCK, tmp + k * SHA_SIZE);
+                    for (k = 0; k < ctx->large_block / ctx->small_block; k++) {
+                        sha(ctx, src + k * ctx->small_block, ctx->small_block, tmp + k * SHA_SIZE);
                     }
-                    sha(tmp, LARGE_BLOCK / SMALL_BLOCK * SHA_SIZE, s);
+                    sha(ctx, tmp, ctx->large_block / ctx->small_block * SHA_SIZE, s);
                 } else {
-                    sha(src, block, s);
+                    sha(ctx, src, block, s);
                 }
 
-                pthread_mutex_lock_wrapper(&table_mutex);
+                pthread_mutex_lock_wrapper(&ctx->table_mutex);
+                e = get_entry(ctx, j, no, over);
 
-                if (dd_equal(s, table[j][no].sha, SHA_SIZE) && table[j][no].hash == uint16_t(w) && used(table[j][no]) &&
-                    (!add_data || (table[j][no].offset + block < pay + (src - orig_src)))) {
+                if (dd_equal(s, e.sha, sha_size(ctx)) && e.hash == uint16_t(w) && used(e) && (committed || (e.offset + block < pay + (src - orig_src)))) {
                     collision_skip = 32;
-                    *payload_ref = table[j][no].offset;
-                    pthread_mutex_unlock_wrapper(&table_mutex);
+                    *payload_ref = e.offset;
+                    pthread_mutex_unlock_wrapper(&ctx->table_mutex);
 
-                    if (block == LARGE_BLOCK) {
-                        largehits += block;
+                    if (block == ctx->large_block) {
+                        ctx->largehits += block;
                     } else {
-                        smallhits += block;
+                        ctx->smallhits += block;
                     }
 
                     return src;
                 } else {
                     char c;
                     src += collision_skip;
-                    collision_skip = collision_skip * 2 > LARGE_BLOCK ? LARGE_BLOCK : collision_skip * 2;
+                    collision_skip = collision_skip * 2 > ctx->large_block ? ctx->large_block : collision_skip * 2;
                     c = *src;
                     while (src <= last_src && *src == c) {
                         src++;
                     }
                 }
 
-                pthread_mutex_unlock_wrapper(&table_mutex);
+                pthread_mutex_unlock_wrapper(&ctx->table_mutex);
             } else {
                 src = w_pos;
             }
@@ -602,28 +799,43 @@ INLINE const static unsigned char *dub(const unsigned char *src, uint64_t pay, s
     return 0;
 }
 
-INLINE static void hashat(const unsigned char *src, uint64_t pay, size_t len, int no, unsigned char *hash, int overwrite) {
+INLINE static void hashat(dup_ctx *ctx, const unsigned char *src, uint64_t pay, size_t len, int no, unsigned char *hash, int overwrite) {
     const unsigned char *o;
     uint64_t w = window(src, len, &o);
-    uint64_t j = entry(w);
+    bool over = !ctx->add_data;
+    uint64_t j = entry(ctx, w, over);
 
-    pthread_mutex_lock_wrapper(&table_mutex);
+    if (ctx->compact && pay > COMPACT_MAX_OFFSET) {
+        return;
+    }
 
-    if ((overwrite == 0 && !used(table[j][no])) || (overwrite == 1 && (!used(table[j][no]) || table[j][no].hash != uint16_t(w))) || (overwrite == 2)) {
-        if (!dd_equal(hash, table[j][no].sha, SHA_SIZE)) {
-            table[j][no].hash = static_cast<uint16_t>(w);
-            table[j][no].offset = pay;
+    pthread_mutex_lock_wrapper(&ctx->table_mutex);
+    if (over) {
+        // Already found in the read-only table
+        hash_t b = get_entry(ctx, entry(ctx, w), no);
+        if (used(b) && dd_equal(hash, b.sha, sha_size(ctx))) {
+            pthread_mutex_unlock_wrapper(&ctx->table_mutex);
+            return;
+        }
+    }
+    hash_t e = get_entry(ctx, j, no, over);
+
+    if ((overwrite == 0 && !used(e)) || (overwrite == 1 && (!used(e) || e.hash != uint16_t(w))) || (overwrite == 2)) {
+        if (!dd_equal(hash, e.sha, sha_size(ctx))) {
+            e.hash = static_cast<uint16_t>(w);
+            e.offset = pay;
 
-            memcpy((unsigned char *)table[j][no].sha, hash, SHA_SIZE);
+            memcpy((unsigned char *)e.sha, hash, SHA_SIZE);
 
             assert(o - src <= 0xffffull);
-            table[j][no].slide = static_cast<uint16_t>(o - src);
+            e.slide = static_cast<uint16_t>(o - src);
 
-            static_assert(is_same<decltype(table[j][no].slide), uint16_t>::value);
+            static_assert(is_same<decltype(e.slide), uint16_t>::value);
+            set_entry(ctx, j, no, e, over);
         }
     }
 
-    pthread_mutex_unlock_wrapper(&table_mutex);
+    pthread_mutex_unlock_wrapper(&ctx->table_mutex);
 }
 
 static size_t write_match(size_t length, uint64_t payload, unsigned char *dst) {
@@ -641,17 +853,29 @@ static size_t write_match(size_t length, uint64_t payload, unsigned char *dst) {
     return 0;
 }
 
-INLINE static size_t write_literals(const unsigned char *src, size_t length, unsigned char *dst, int thread_id) {
+// Same layout as a match packet, but the payload field holds the byte value to repeat
+static size_t write_fill(size_t length, unsigned char value, unsigned char *dst) {
+    memcpy(dst, DUP_FILL, 2);
+    dst += 8 - 6;
+    ll2str(32 - (6 + 8), (char *)dst, 4);
+    dst += 4;
+    ll2str(length, (char *)dst, 4);
+    dst += 4;
+    ll2str(value, (char *)dst, 8);
+    return 32 - (6 + 8);
+}
+
+INLINE static size_t write_literals(dup_ctx *ctx, const unsigned char *src, size_t length, unsigned char *dst, int thread_id) {
     if (length > 0) {
         size_t r;
-        if (LEVEL == 0) {
+        if (ctx->level == 0) {
             dst[32 - (6 + 8)] = '0';
             memcpy(dst + 33 - (6 + 8), src, length);
             r = length + 1;
-        } else if (LEVEL >= 1 && LEVEL <= 3) {
-            int zstd_level = LEVEL == 1 ? 1 : LEVEL == 2 ? 10 : 19;
-            dst[32 - (6 + 8)] = char(LEVEL + '0');
-            r = zstd_compress((char *)src, length, (char *)dst + 33 - (6 + 8) + 4 + 4, 2 * length + 1000000, zstd_level, jobs[thread_id].zstd);
+        } else if (ctx->level >= 1 && ctx->level <= 3) {
+            int zstd_level = ctx->level == 1 ? 1 : ctx->level == 2 ? 10 : 19;
+            dst[32 - (6 + 8)] = char(ctx->level + '0');
+            r = zstd_compress((char *)src, length, (char *)dst + 33 - (6 + 8) + 4 + 4, 2 * length + 1000000, zstd_level, ctx->jobs[thread_id].zstd);
             *((int32_t *)(dst + 33 - (6 + 8))) = (int32_t)r;
             r += 4; // LEN C
             *((int32_t *)(dst + 33 - (6 + 8) + 4)) = (int32_t)length;
@@ -692,12 +916,12 @@ INLINE static size_t cons_flush(unsigned char *dst, uint64_t *q_pay, uint64_t *q
     return dst - orig_dst;
 }
 
-INLINE static size_t cons_match(size_t length, uint64_t payload, unsigned char *dst, uint64_t *q_pay, uint64_t *q_len, uint64_t *q_com) {
+INLINE static size_t cons_match(dup_ctx *ctx, size_t length, uint64_t payload, unsigned char *dst, uint64_t *q_pay, uint64_t *q_len, uint64_t *q_com) {
 #ifdef NAIVE
     return write_match(length, payload, dst);
 #endif
 
-    if (*q_len > 0 && payload == *q_pay + *q_len && (payload + length < *q_com || !add_data) && *q_len + length <= OUT_BLOCK_SIZE) {
+    if (*q_len > 0 && payload == *q_pay + *q_len && (payload + length < *q_com || (!ctx->add_data && ctx->overlay_entries == 0)) && *q_len + length <= OUT_BLOCK_SIZE) {
         *q_len += length;
         return 0;
     } else {
@@ -708,11 +932,11 @@ INLINE static size_t cons_match(size_t length, uint64_t payload, unsigned char *
     }
 }
 
-INLINE static size_t cons_literals(const unsigned char *src, size_t length, unsigned char *dst, int thread_id, uint64_t *q_pay, uint64_t *q_len,
+INLINE static size_t cons_literals(dup_ctx *ctx, const unsigned char *src, size_t length, unsigned char *dst, int thread_id, uint64_t *q_pay, uint64_t *q_len,
                                    uint64_t *q_com) {
 
 #ifdef NAIVE
-    return write_literals(src, length, dst, thread_id);
+    return write_literals(ctx, src, length, dst, thread_id);
 #endif
     unsigned char *orig_dst = dst;
     size_t original_length = length;
@@ -720,7 +944,7 @@ INLINE static size_t cons_literals(const unsigned char *src, size_t length, unsi
 
     while (length > 0) {
         size_t process = minimum(OUT_BLOCK_SIZE, length);
-        dst += write_literals(src, process, dst, thread_id);
+        dst += write_literals(ctx, src, process, dst, thread_id);
         length -= process;
         src += process;
     }
@@ -728,40 +952,50 @@ INLINE static size_t cons_literals(const unsigned char *src, size_t length, unsi
     return dst - orig_dst;
 }
 
-INLINE static void hash_chunk(const unsigned char *src, uint64_t pay, size_t length, int policy) {
+INLINE static void hash_chunk(dup_ctx *ctx, const unsigned char *src, uint64_t pay, size_t length, int policy) {
     char tmp[512 * SHA_SIZE];
-    assert(sizeof(tmp) >= SHA_SIZE * LARGE_BLOCK / SMALL_BLOCK);
+    assert(sizeof(tmp) >= SHA_SIZE * ctx->large_block / ctx->small_block);
 
-    size_t small_blocks = length / SMALL_BLOCK;
+    size_t small_blocks = length / ctx->small_block;
     uint32_t smalls = 0;
+    uint32_t constants = 0;
     uint32_t j = 0;
 
     for (j = 0; j < small_blocks; j++) {
-        sha(src + j * SMALL_BLOCK, SMALL_BLOCK, (unsigned char *)tmp + smalls * SHA_SIZE);
-        hashat(src + j * SMALL_BLOCK, pay + j * SMALL_BLOCK, SMALL_BLOCK, 0, (unsigned char *)tmp + smalls * SHA_SIZE, policy);
+        sha(ctx, src + j * ctx->small_block, ctx->small_block, (unsigned char *)tmp + smalls * SHA_SIZE);
+
+        // Constant blocks are emitted as fill packets by process_chunk(ctx) and would only waste table entries
+        if (run_length(src + j * ctx->small_block, ctx->small_block) == ctx->small_block) {
+            constants++;
+        } else {
+            hashat(ctx, src + j * ctx->small_block, pay + j * ctx->small_block, ctx->small_block, 0, (unsigned char *)tmp + smalls * SHA_SIZE, policy);
+        }
 
         smalls++;
-        if (smalls == LARGE_BLOCK / SMALL_BLOCK) {
-            unsigned char tmp2[SHA_SIZE];
-            sha((unsigned char *)tmp, smalls * SHA_SIZE, tmp2);
-            hashat(src + (j + 1) * SMALL_BLOCK - LARGE_BLOCK, pay + (j + 1) * SMALL_BLOCK - LARGE_BLOCK, LARGE_BLOCK, 1, (unsigned char *)tmp2, policy);
+        if (smalls == ctx->large_block / ctx->small_block) {
+            if (constants < smalls) {
+                unsigned char tmp2[SHA_SIZE];
+                sha(ctx, (unsigned char *)tmp, smalls * SHA_SIZE, tmp2);
+                hashat(ctx, src + (j + 1) * ctx->small_block - ctx->large_block, pay + (j + 1) * ctx->small_block - ctx->large_block, ctx->large_block, 1, (unsigned char *)tmp2, policy);
+            }
 
             smalls = 0;
+            constants = 0;
         }
     }
 
-    size_t rem_size = length - SMALL_BLOCK * small_blocks;
-    size_t rem_offset = SMALL_BLOCK * small_blocks;
+    size_t rem_size = length - ctx->small_block * small_blocks;
+    size_t rem_offset = ctx->small_block * small_blocks;
 
     if (rem_size >= 128) {
-        sha(src + rem_offset, rem_size, (unsigned char *)tmp);
-        hashat(src + rem_offset, pay + rem_offset, rem_size, 0, (unsigned char *)tmp, policy);
+        sha(ctx, src + rem_offset, rem_size, (unsigned char *)tmp);
+        hashat(ctx, src + rem_offset, pay + rem_offset, rem_size, 0, (unsigned char *)tmp, policy);
     }
 
     return;
 }
 
-INLINE static size_t process_chunk(const unsigned char *src, uint64_t pay, size_t length, unsigned char *dst, int thread_id) {
+INLINE static size_t process_data(dup_ctx *ctx, const unsigned char *src, uint64_t pay, size_t length, unsigned char *dst, int thread_id) {
     size_t buffer = length;
     const unsigned char *last_valid = src + buffer - 1;
     const unsigned char *upto;
@@ -777,8 +1011,8 @@ INLINE static size_t process_chunk(const unsigned char *src, uint64_t pay, size_
         uint64_t ref = 0;
         const unsigned char *match = 0;
 
-        if (src + LARGE_BLOCK - 1 <= last_valid) {
-            match = dub(src, pay + (src - src_orig), last - src, LARGE_BLOCK, 1, &ref);
+        if (src + ctx->large_block - 1 <= last_valid) {
+            match = dub(ctx, src, pay + (src - src_orig), last - src, ctx->large_block, 1, &ref);
         }
         upto = (match == 0 ? last : match - 1);
 
@@ -786,21 +1020,21 @@ INLINE static size_t process_chunk(const unsigned char *src, uint64_t pay, size_
             uint64_t ref_s = 0;
             const unsigned char *match_s = 0;
 
-            if (src + SMALL_BLOCK - 1 <= last_valid) {
-                match_s = dub(src, pay + (src - src_orig), (upto - src), SMALL_BLOCK, 0, &ref_s);
+            if (src + ctx->small_block - 1 <= last_valid) {
+                match_s = dub(ctx, src, pay + (src - src_orig), (upto - src), ctx->small_block, 0, &ref_s);
             } else if (src + 256 - 1 <= last_valid) {
-                match_s = dub(src, pay + (src - src_orig), (upto - src), last_valid - src + 1, 0, &ref_s);
+                match_s = dub(ctx, src, pay + (src - src_orig), (upto - src), last_valid - src + 1, 0, &ref_s);
             }
 
             if (match_s == 0) {
-                dst += cons_literals(src, upto - src + 1, dst, thread_id, &q_pay, &q_len, &q_com);
+                dst += cons_literals(ctx, src, upto - src + 1, dst, thread_id, &q_pay, &q_len, &q_com);
                 break;
             } else {
                 if (match_s - src > 0) {
-                    dst += cons_literals(src, match_s - src, dst, thread_id, &q_pay, &q_len, &q_com);
+                    dst += cons_literals(ctx, src, match_s - src, dst, thread_id, &q_pay, &q_len, &q_com);
                 }
-                dst += cons_match(minimum(SMALL_BLOCK, upto - match_s + 1), ref_s, dst, &q_pay, &q_len, &q_com);
-                src = match_s + SMALL_BLOCK;
+                dst += cons_match(ctx, minimum(ctx->small_block, upto - match_s + 1), ref_s, dst, &q_pay, &q_len, &q_com);
+                src = match_s + ctx->small_block;
             }
         }
 
@@ -808,8 +1042,8 @@ INLINE static size_t process_chunk(const unsigned char *src, uint64_t pay, size_
             dst += cons_flush(dst, &q_pay, &q_len, &q_com);
             return dst - dst_orig;
         } else {
-            dst += cons_match(minimum(LARGE_BLOCK, last - match + 1), ref, dst, &q_pay, &q_len, &q_com);
-            src = match + LARGE_BLOCK;
+            dst += cons_match(ctx, minimum(ctx->large_block, last - match + 1), ref, dst, &q_pay, &q_len, &q_com);
+            src = match + ctx->large_block;
         }
     }
 
@@ -817,169 +1051,405 @@ INLINE static size_t process_chunk(const unsigned char *src, uint64_t pay, size_
     return dst - dst_orig;
 }
 
-vector<uint64_t> ins;
-vector<uint64_t> outs;
+// Splits the chunk into runs of identical bytes, which are emitted as fill packets, and the data in between which
+// is deduplicated by process_data(ctx). Runs are searched by testing 16 bytes at every DUP_FILL_MIN / 2 positions, which
+// is guaranteed to hit any run of DUP_FILL_MIN bytes or more
+INLINE static size_t process_chunk(dup_ctx *ctx, const unsigned char *src, uint64_t pay, size_t length, unsigned char *dst, int thread_id) {
+    unsigned char *dst_orig = dst;
+    const unsigned char *end = src + length;
+    const unsigned char *pending = src;
+    const unsigned char *p = src;
+
+    while (p + 16 <= end) {
+        if (run_length(p, 16) == 16) {
+            const unsigned char *begin = p;
+            while (begin > pending && *(begin - 1) == *p) {
+                begin--;
+            }
+            size_t run = (p - begin) + run_length(p, end - p);
+
+            if (run >= DUP_FILL_MIN) {
+                if (begin > pending) {
+                    dst += process_data(ctx, pending, pay + (pending - src), begin - pending, dst, thread_id);
+                }
+                dst += write_fill(run, *p, dst);
+                pending = begin + run;
+                p = pending;
+                continue;
+            }
+        }
+        p += DUP_FILL_MIN / 2;
+    }
+
+    if (pending < end) {
+        dst += process_data(ctx, pending, pay + (pending - src), end - pending, dst, thread_id);
+    }
+    return dst - dst_orig;
+}
 
 // Public interface
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-char inlined[DUP_MAX_INPUT];
-uint64_t flushed;
-uint64_t global_payload;
-uint64_t count_payload;
-uint64_t count_compressed;
-
-INLINE static int get_free(void) {
+INLINE static int get_free(dup_ctx *ctx) {
     int i;
-    for (i = 0; i < THREADS; i++) {
-        pthread_mutex_lock_wrapper(&jobs[i].jobmutex);
-        if (!jobs[i].busy && jobs[i].size_source == 0 && jobs[i].size_destination == 0) {
+    for (i = 0; i < ctx->threads; i++) {
+        pthread_mutex_lock_wrapper(&ctx->jobs[i].jobmutex);
+        if (!ctx->jobs[i].busy && ctx->jobs[i].size_source == 0 && ctx->jobs[i].size_destination == 0) {
             return i;
         }
-        pthread_mutex_unlock_wrapper(&jobs[i].jobmutex);
+        pthread_mutex_unlock_wrapper(&ctx->jobs[i].jobmutex);
     }
     return -1;
 }
 
-INLINE static void *compress_thread(void *arg) {
-    job_t *me = (job_t *)arg;
+// Worker threads are shared by all contexts. Jobs of any context are queued here and picked up by the first idle
+// worker. The pool grows to the largest thread count of any live context and is stopped with the last context
+struct pool_t {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    deque<job_t *> queue;
+    vector<pthread_t> threads;
+    int contexts = 0;
+    bool exit = false;
+};
 
-    while (!exit_threads) {
-        pthread_mutex_lock_wrapper(&me->jobmutex);
-        // Nothing to do, or waiting for consumer to fetch result
-        while (me->size_source == 0 || me->size_destination > 0) {
-            pthread_cond_wait_wrapper(&me->cond, &me->jobmutex);
-            if (exit_threads) {
-                return 0;
-            }
-        }
+pool_t pool;
+mutex pool_lifetime;
 
-        me->busy = true;
-        pthread_mutex_unlock_wrapper(&me->jobmutex);
+INLINE static void compress_job(job_t *me) {
+    dup_ctx *ctx = me->ctx;
+    pthread_mutex_lock_wrapper(&me->jobmutex);
+    me->busy = true;
+    pthread_mutex_unlock_wrapper(&me->jobmutex);
 
-        int policy = 1;
-        int order = 0;
+    int policy = 1;
+    int order = 0;
 
-        if (order == 1) {
-            me->size_destination = process_chunk(me->source, me->payload, me->size_source, me->destination, me->id);
-            if (me->add) {
-                hash_chunk(me->source, me->payload, me->size_source, policy);
-            }
-        } else {
-            if (me->add) {
-                hash_chunk(me->source, me->payload, me->size_source, policy);
-            }
-            me->size_destination = process_chunk(me->source, me->payload, me->size_source, me->destination, me->id);
+    if (order == 1) {
+        me->size_destination = process_chunk(ctx, me->source, me->payload, me->size_source, me->destination, me->id);
+        if (me->add) {
+            hash_chunk(ctx, me->source, me->payload, me->size_source, policy);
+        }
+    } else {
+        if (me->add) {
+            hash_chunk(ctx, me->source, me->payload, me->size_source, policy);
         }
+        me->size_destination = process_chunk(ctx, me->source, me->payload, me->size_source, me->destination, me->id);
+    }
+
+    pthread_mutex_lock_wrapper(&me->jobmutex);
+    me->busy = false;
+    pthread_mutex_unlock_wrapper(&me->jobmutex);
 
-        pthread_mutex_lock_wrapper(&me->jobmutex);
-        me->busy = false;
-        pthread_mutex_unlock_wrapper(&me->jobmutex);
+    pthread_mutex_lock_wrapper(&ctx->jobdone_mutex);
+    pthread_cond_signal_wrapper(&ctx->jobdone_cond);
+    pthread_mutex_unlock_wrapper(&ctx->jobdone_mutex);
+}
 
-        pthread_mutex_lock_wrapper(&jobdone_mutex);
-        pthread_cond_signal_wrapper(&jobdone_cond);
-        pthread_mutex_unlock_wrapper(&jobdone_mutex);
+static void *compress_thread(void *) {
+    pthread_mutex_lock_wrapper(&pool.mutex);
+    for (;;) {
+        while (pool.queue.empty() && !pool.exit) {
+            pthread_cond_wait_wrapper(&pool.cond, &pool.mutex);
+        }
+        if (pool.queue.empty()) {
+            break;
+        }
+        job_t *me = pool.queue.front();
+        pool.queue.pop_front();
+        pthread_mutex_unlock_wrapper(&pool.mutex);
+        compress_job(me);
+        pthread_mutex_lock_wrapper(&pool.mutex);
     }
+    pthread_mutex_unlock_wrapper(&pool.mutex);
+    return 0;
+}
 
+INLINE static void pool_submit(job_t *job) {
+    pthread_mutex_lock_wrapper(&pool.mutex);
+    pool.queue.push_back(job);
+    pthread_cond_signal_wrapper(&pool.cond);
+    pthread_mutex_unlock_wrapper(&pool.mutex);
+}
+
+static int pool_attach(int thread_count) {
+    lock_guard<mutex> lock(pool_lifetime);
+    pool.contexts++;
+    while (pool.threads.size() < static_cast<size_t>(thread_count)) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, compress_thread, NULL)) {
+            return 2;
+        }
+        pool.threads.push_back(t);
+    }
     return 0;
 }
 
+static void pool_detach(void) {
+    lock_guard<mutex> lock(pool_lifetime);
+    if (--pool.contexts > 0) {
+        return;
+    }
+    pthread_mutex_lock_wrapper(&pool.mutex);
+    pool.exit = true;
+    pthread_cond_broadcast_wrapper(&pool.cond);
+    pthread_mutex_unlock_wrapper(&pool.mutex);
+    for (pthread_t &t : pool.threads) {
+        pthread_join(t, 0);
+    }
+    pool.threads.clear();
+    pool.exit = false;
+}
+
 uint64_t dup_memory(uint64_t bits) {
     uint64_t t = sizeof(hash_t);
     return 2 * t * ((uint64_t)1 << bits);
 }
 
-int dup_init(size_t large_block, size_t small_block, uint64_t mem, int thread_count, void *space, int compression_level, bool crypto_hash, uint64_t hash_seed) {
-    // FIXME: The dup() function contains a stack allocated array ("tmp") of 8
-    // KB that must be able to fit LARGE_BLOCK / SMALL_BLOCK * SHA_SIZE bytes.
-    // Find a better solution. alloca() causes sporadic crash in VC for inlined
-    // functions.
-    assert(large_block <= 512 * 1024);
+#ifdef __linux__
+// Spreads the pages of the table evenly across all online NUMA nodes, so that the random lookups of all threads see
+// the same average latency and the memory bandwidth of every node is used. Calls mbind() through syscall() to avoid
+// depending on libnuma. Returns false if there is only one node
+static bool interleave_nodes(void *p, uint64_t len) {
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (!f) {
+        return false;
+    }
+    unsigned long mask = 0;
+    int nodes = 0;
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(f, "-%d", &last) != 1) {
+            last = first;
+        }
+        for (int n = first; n <= last && n < 64; n++) {
+            mask |= 1ul << n;
+            nodes++;
+        }
+        if (fgetc(f) != ',') {
+            break;
+        }
+    }
+    fclose(f);
 
-    g_crypto_hash = crypto_hash;
-    g_hash_salt = hash_seed;
+    const int MPOL_INTERLEAVE_ = 3;
+    return nodes > 1 && syscall(SYS_mbind, p, len, MPOL_INTERLEAVE_, &mask, 64, 0) == 0;
+}
+#endif
 
-    LEVEL = compression_level;
+#define TABLE_PAGE (2 * 1024 * 1024)
 
-    exit_threads = false;
-    THREADS = thread_count;
+// Tables from dup_table_alloc() that no context has used yet. They are known to be zero, so that init_ctx() and
+// dup_overlay() only need to clear memory that the caller allocated itself or reuses
+static std::unordered_set<void *> fresh_tables;
+static std::mutex fresh_tables_mutex;
 
-    jobs = (job_t *)malloc(sizeof(job_t) * THREADS);
-    if (!jobs) {
-        return 1;
+static void clear_table(void *space, uint64_t mem) {
+    if (!space) {
+        return;
     }
+    {
+        std::lock_guard<std::mutex> lock(fresh_tables_mutex);
+        if (fresh_tables.erase(space) > 0) {
+            return;
+        }
+    }
+    memset(space, 0, mem);
+}
 
-    memset(jobs, 0, sizeof(job_t) * THREADS);
+// Allocates zero-initialized memory for the hashtable. Fresh anonymous pages are already zero and are faulted in by
+// whichever thread first touches them, so no serial memset is needed. Explicit huge pages are tried first, then
+// transparent huge pages, to reduce TLB misses of the random lookups
+void *dup_table_alloc(uint64_t mem, bool interleave, int *placement) {
+    uint64_t len = (mem + TABLE_PAGE - 1) / TABLE_PAGE * TABLE_PAGE;
+    int got = 0;
+#ifdef WINDOWS
+    (void)interleave;
+    void *p = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!p) {
+        return 0;
+    }
+#else
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    got |= p != MAP_FAILED ? DUP_TABLE_HUGETLB : 0;
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return 0;
+        }
+#ifdef MADV_HUGEPAGE
+        got |= madvise(p, len, MADV_HUGEPAGE) == 0 ? DUP_TABLE_THP : 0;
+#endif
+    }
+#ifdef __linux__
+    got |= interleave && interleave_nodes(p, len) ? DUP_TABLE_INTERLEAVED : 0;
+#else
+    (void)interleave;
+#endif
+#endif
+    {
+        std::lock_guard<std::mutex> lock(fresh_tables_mutex);
+        fresh_tables.insert(p);
+    }
+    if (placement) {
+        *placement = got;
+    }
+    return p;
+}
 
-    for (int i = 0; i < THREADS; i++) {
-        (void)*(new (&jobs[i])(job_t)());
+void dup_table_free(void *table, uint64_t mem) {
+    if (table) {
+        {
+            std::lock_guard<std::mutex> lock(fresh_tables_mutex);
+            fresh_tables.erase(table);
+        }
+#ifdef WINDOWS
+        (void)mem;
+        VirtualFree(table, 0, MEM_RELEASE);
+#else
+        munmap(table, (mem + TABLE_PAGE - 1) / TABLE_PAGE * TABLE_PAGE);
+#endif
     }
+}
+
+static void zstd_free(char *workmem) {
+    if (workmem) {
+        zstd_params_s *zstd_params = (zstd_params_s *)workmem;
+        ZSTD_freeCCtx(zstd_params->cctx);
+        ZSTD_freeDCtx(zstd_params->dctx);
+        free(workmem);
+    }
+}
+
+static int init_ctx(dup_ctx *ctx, size_t large_block, size_t small_block, uint64_t mem, int thread_count, void *space, int compression_level,
+                    bool crypto_hash, uint64_t hash_seed, bool compact) {
+    // FIXME: The dup() function contains a stack allocated array ("tmp") of 8
+    // KB that must be able to fit LARGE_BLOCK / SMALL_BLOCK * SHA_SIZE bytes.
+    // Find a better solution. alloca() causes sporadic crash in VC for inlined
+    // functions.
+    assert(large_block <= 512 * 1024);
+
+    ctx->crypto_hash = crypto_hash;
+    ctx->hash_salt = hash_seed;
+
+    ctx->level = compression_level;
+    ctx->add_data = true;
+
+    ctx->threads = thread_count;
 
 #ifdef WINDOWS
     pthread_win32_process_attach_np();
 #endif
 
-    pthread_mutex_init(&table_mutex, NULL);
-
-    pthread_mutex_init(&jobdone_mutex, NULL);
-    pthread_cond_init(&jobdone_cond, NULL);
+    pthread_mutex_init(&ctx->table_mutex, NULL);
 
-    SMALL_BLOCK = small_block;
-    LARGE_BLOCK = large_block;
+    pthread_mutex_init(&ctx->jobdone_mutex, NULL);
+    pthread_cond_init(&ctx->jobdone_cond, NULL);
 
-    HASH_ENTRIES = (mem - COMPRESSED_HASHTABLE_OVERHEAD) / (2 * sizeof(hash_t));
+    if (pool_attach(thread_count) != 0) {
+        return 2;
+    }
 
-    table = (hash_t(*)[2])space;
+    ctx->jobs = (job_t *)malloc(sizeof(job_t) * ctx->threads);
+    if (!ctx->jobs) {
+        return 1;
+    }
 
-    memset(space, 0, mem);
+    memset(ctx->jobs, 0, sizeof(job_t) * ctx->threads);
 
-    global_payload = 0;
-    flushed = 0;
-    count_payload = 0;
-    count_compressed = 0;
+    for (int i = 0; i < ctx->threads; i++) {
+        (void)*(new (&ctx->jobs[i])(job_t)());
+    }
 
-    for (int i = 0; i < THREADS; i++) {
-        pthread_mutex_init(&jobs[i].jobmutex, NULL);
-        pthread_cond_init(&jobs[i].cond, NULL);
-        jobs[i].id = i;
-        jobs[i].size_destination = 0;
-        jobs[i].size_source = 0;
-        jobs[i].zstd = zstd_init();
+    ctx->small_block = small_block;
+    ctx->large_block = large_block;
 
-        jobs[i].busy = false;
+    ctx->compact = compact;
+    if (mem <= COMPRESSED_HASHTABLE_OVERHEAD) {
+        // Context that is only used for decompression
+        ctx->hash_entries = 0;
+    } else if (ctx->compact) {
+        // Each bucket of two entries also needs 2 bits in the bitmap of dup_compress_hashtable()
+        ctx->hash_entries = (mem - COMPRESSED_HASHTABLE_OVERHEAD) * 4 / (4 * 2 * sizeof(compact_t) + 1);
+    } else {
+        ctx->hash_entries = (mem - COMPRESSED_HASHTABLE_OVERHEAD) / (2 * sizeof(hash_t));
     }
 
-    for (int i = 0; i < THREADS; i++) {
-        int t = pthread_create(&jobs[i].thread, NULL, compress_thread, &jobs[i]);
-        if (t) {
-            return 2;
-        }
+    clear_table(space, mem);
+    ctx->table = (hash_t(*)[2])space;
+    ctx->compact_table = (compact_t(*)[2])space;
+    ctx->overlay = 0;
+    ctx->compact_overlay = 0;
+    ctx->overlay_entries = 0;
+
+    ctx->global_payload = 0;
+    ctx->flushed = 0;
+    ctx->count_payload = 0;
+    ctx->count_compressed = 0;
+    ctx->largehits = 0;
+    ctx->smallhits = 0;
+
+    for (int i = 0; i < ctx->threads; i++) {
+        pthread_mutex_init(&ctx->jobs[i].jobmutex, NULL);
+        ctx->jobs[i].ctx = ctx;
+        ctx->jobs[i].id = i;
+        ctx->jobs[i].size_destination = 0;
+        ctx->jobs[i].size_source = 0;
+        ctx->jobs[i].zstd = zstd_init();
+
+        ctx->jobs[i].busy = false;
     }
 
 #if 0
-	cerr << "\nHASH ENTRIES = " << HASH_ENTRIES << "\n";
+	cerr << "\nHASH ENTRIES = " << ctx->hash_entries << "\n";
 	cerr << "\nHASH SIZE = " << sizeof(hash_t) << "\n";
 #endif
 
     return 0;
 }
 
-void dup_deinit(void) {
-    int i;
-    exit_threads = true;
+// All data must have been flushed, so that no job is queued or running
+static void deinit_ctx(dup_ctx *ctx) {
+    pool_detach();
 
-    for (i = 0; i < THREADS; i++) {
-        pthread_mutex_lock_wrapper(&jobs[i].jobmutex);
-        pthread_cond_signal_wrapper(&jobs[i].cond);
-        pthread_mutex_unlock_wrapper(&jobs[i].jobmutex);
-        pthread_join(jobs[i].thread, 0);
+    if (ctx->jobs != 0) {
+        for (int i = 0; i < ctx->threads; i++) {
+            zstd_free(ctx->jobs[i].zstd);
+            pthread_mutex_destroy(&ctx->jobs[i].jobmutex);
+        }
+        free(ctx->jobs);
+        ctx->jobs = 0;
     }
+    zstd_free(ctx->zstd_decompress_state);
+    ctx->zstd_decompress_state = 0;
+}
 
-    if (jobs != 0) {
-        free(jobs);
+int dup_create(dup_ctx **ctx, size_t large_block, size_t small_block, uint64_t mem, int thread_count, void *space, int compression_level, bool crypto_hash,
+               uint64_t hash_seed, bool compact) {
+    *ctx = new (nothrow) dup_ctx();
+    if (!*ctx) {
+        return 1;
     }
+    int r = init_ctx(*ctx, large_block, small_block, mem, thread_count, space, compression_level, crypto_hash, hash_seed, compact);
+    if (r != 0) {
+        dup_destroy(*ctx);
+        *ctx = 0;
+    }
+    return r;
+}
+
+void dup_destroy(dup_ctx *ctx) {
+    deinit_ctx(ctx);
+    pthread_mutex_destroy(&ctx->table_mutex);
+    pthread_mutex_destroy(&ctx->jobdone_mutex);
+    pthread_cond_destroy(&ctx->jobdone_cond);
+    delete ctx;
 }
 
 size_t dup_size_compressed(const unsigned char *src) {
@@ -992,13 +1462,13 @@ size_t dup_size_decompressed(const unsigned char *src) {
     return t;
 }
 
-uint64_t dup_counter_payload(void) { return count_payload; }
+uint64_t dup_counter_payload(dup_ctx *ctx) { return ctx->count_payload; }
 
-uint64_t dup_counter_compressed(void) { return count_compressed; }
+uint64_t dup_counter_compressed(dup_ctx *ctx) { return ctx->count_compressed; }
 
-void dup_counters_reset(void) {
-    count_payload = 0;
-    count_compressed = 0;
+void dup_counters_reset(dup_ctx *ctx) {
+    ctx->count_payload = 0;
+    ctx->count_compressed = 0;
 }
 
 INLINE static uint64_t packet_payload(const unsigned char *src) {
@@ -1006,9 +1476,9 @@ INLINE static uint64_t packet_payload(const unsigned char *src) {
     return t;
 }
 
-int dup_decompress(const unsigned char *src, unsigned char *dst, size_t *length, uint64_t *payload) {
-    if (zstd_decompress_state == 0) {
-        zstd_decompress_state = zstd_init();
+int dup_decompress(dup_ctx *ctx, const unsigned char *src, unsigned char *dst, size_t *length, uint64_t *payload) {
+    if (ctx->zstd_decompress_state == 0) {
+        ctx->zstd_decompress_state = zstd_init();
     }
 
     if (dd_equal(src, DUP_LITERAL, 8 - 6)) {
@@ -1021,7 +1491,7 @@ int dup_decompress(const unsigned char *src, unsigned char *dst, size_t *length,
         } else if (*src == '1' || *src == '2' || *src == '3') {
             int32_t len = *(int32_t *)((src) + 1);
             int32_t len_de = *(int32_t *)((src) + 1 + 4);
-            t = zstd_decompress((char *)(src) + 1 + 4 + 4, len, (char *)dst, len_de, 0, 0, zstd_decompress_state);
+            t = zstd_decompress((char *)(src) + 1 + 4 + 4, len, (char *)dst, len_de, 0, 0, ctx->zstd_decompress_state);
             t = len_de;
         } else {
             // todo, handle outside lib
@@ -1031,8 +1501,8 @@ int dup_decompress(const unsigned char *src, unsigned char *dst, size_t *length,
         }
 
         *length = t;
-        count_payload += *length;
-        count_compressed += dup_size_compressed(src - 32 + (6 + 8));
+        ctx->count_payload += *length;
+        ctx->count_compressed += dup_size_compressed(src - 32 + (6 + 8));
         return 0;
     }
     if (dd_equal(src, DUP_MATCH, 8 - 6)) {
@@ -1040,9 +1510,16 @@ int dup_decompress(const unsigned char *src, unsigned char *dst, size_t *length,
         size_t len = dup_size_decompressed(src);
         *payload = pay;
         *length = len;
-        count_payload += *length;
-        count_compressed += dup_size_compressed(src - 32 + (6 + 8));
+        ctx->count_payload += *length;
+        ctx->count_compressed += dup_size_compressed(src - 32 + (6 + 8));
         return 1;
+    }
+    if (dd_equal(src, DUP_FILL, 8 - 6)) {
+        *payload = packet_payload(src);
+        *length = dup_size_decompressed(src);
+        ctx->count_payload += *length;
+        ctx->count_compressed += dup_size_compressed(src);
+        return 2;
     } else {
         return -2;
     }
@@ -1070,48 +1547,83 @@ int dup_decompress_simulate(const unsigned char *src, size_t *length, uint64_t *
         *payload = pay;
         *length = len;
         return 1;
+    }
+    if (dd_equal(src, DUP_FILL, 8 - 6)) {
+        *payload = packet_payload(src);
+        *length = dup_size_decompressed(src);
+        return 2;
     } else {
         return -2;
     }
 }
 
-size_t flush_pend(char *dst, uint64_t *payloadret) {
+size_t flush_pend(dup_ctx *ctx, char *dst, uint64_t *payloadret) {
     char *orig_dst = dst;
     *payloadret = 0;
     int i;
-    for (i = 0; i < THREADS; i++) {
-        pthread_mutex_lock_wrapper(&jobs[i].jobmutex);
-        if (!jobs[i].busy && jobs[i].size_destination > 0 && jobs[i].payload == flushed) {
-            memcpy(dst, jobs[i].destination, jobs[i].size_destination);
-            dst += jobs[i].size_destination;
-            flushed += jobs[i].size_source;
-            jobs[i].size_destination = 0;
-            *payloadret = jobs[i].size_source;
-            jobs[i].size_source = 0;
-            pthread_mutex_unlock_wrapper(&jobs[i].jobmutex);
+    for (i = 0; i < ctx->threads; i++) {
+        pthread_mutex_lock_wrapper(&ctx->jobs[i].jobmutex);
+        if (!ctx->jobs[i].busy && ctx->jobs[i].size_destination > 0 && ctx->jobs[i].payload == ctx->flushed) {
+            memcpy(dst, ctx->jobs[i].destination, ctx->jobs[i].size_destination);
+            dst += ctx->jobs[i].size_destination;
+            ctx->flushed += ctx->jobs[i].size_source;
+            ctx->jobs[i].size_destination = 0;
+            *payloadret = ctx->jobs[i].size_source;
+            ctx->jobs[i].size_source = 0;
+            pthread_mutex_unlock_wrapper(&ctx->jobs[i].jobmutex);
             break;
         }
-        pthread_mutex_unlock_wrapper(&jobs[i].jobmutex);
+        pthread_mutex_unlock_wrapper(&ctx->jobs[i].jobmutex);
     }
     return dst - orig_dst;
 }
 
-void dup_add(bool add) { add_data = add; }
+void dup_add(dup_ctx *ctx, bool add) { ctx->add_data = add; }
+
+void dup_overlay(dup_ctx *ctx, void *space, uint64_t mem) {
+    clear_table(space, mem);
+    ctx->overlay = (hash_t(*)[2])space;
+    ctx->compact_overlay = (compact_t(*)[2])space;
+    ctx->overlay_entries = mem / (2 * (ctx->compact ? sizeof(compact_t) : sizeof(hash_t)));
+}
+
+void dup_set_payload(dup_ctx *ctx, uint64_t payload) {
+    ctx->global_payload = payload;
+    ctx->flushed = payload;
+}
+
+uint64_t dup_get_flushed(dup_ctx *ctx) { return ctx->flushed; }
+
+// Waits for a free job while flushing finished ones to *dst. Must be called with jobdone_mutex held, and returns with
+// the jobmutex of the job held
+INLINE static int acquire_job(dup_ctx *ctx, char **dst, uint64_t *payloadreturned) {
+    [[maybe_unused]] char *dst_orig = *dst;
+    int f = -1;
+    do {
+        *dst += flush_pend(ctx, *dst, payloadreturned);
+        f = get_free(ctx);
 
-uint64_t dup_get_flushed() { return flushed; }
+        assert(!(*dst != dst_orig && f == -1));
 
-INLINE size_t dup_compress2(const void *src, char *dst, size_t size, uint64_t *payloadreturned) {
+        if (f == -1) {
+            pthread_cond_wait_wrapper(&ctx->jobdone_cond, &ctx->jobdone_mutex);
+        }
+    } while (f == -1);
+    return f;
+}
+
+INLINE size_t dup_compress2(dup_ctx *ctx, const void *src, char *dst, size_t size, uint64_t *payloadreturned) {
     char *dst_orig = dst;
     *payloadreturned = 0;
 
 #if 0 // single threaded naive for debugging
 	if (size > 0)
 	{
-		size_t t = process_chunk((unsigned char*)src, global_payload, size, (unsigned char*)dst, 1);
-		if (add_data) {
-			hash_chunk((unsigned char*)src, global_payload, size);
+		size_t t = process_chunk(ctx, (unsigned char*)src, ctx->global_payload, size, (unsigned char*)dst, 1);
+		if (ctx->add_data) {
+			hash_chunk(ctx, (unsigned char*)src, ctx->global_payload, size);
 		}
-		global_payload += size;
+		ctx->global_payload += size;
 		return t;
 	}
 	else
@@ -1119,44 +1631,197 @@ INLINE size_t dup_compress2(const void *src, char *dst, size_t size, uint64_t *p
 #endif
 
     if (size > 0) {
-        int f = -1;
-        pthread_mutex_lock_wrapper(&jobdone_mutex);
-        do {
-            dst += flush_pend(dst, payloadreturned);
-            f = get_free();
+        pthread_mutex_lock_wrapper(&ctx->jobdone_mutex);
+        int f = acquire_job(ctx, &dst, payloadreturned);
+
+        memcpy(ctx->jobs[f].source, src, size);
+        ctx->jobs[f].payload = ctx->global_payload;
+        ctx->global_payload += size;
+        ctx->count_payload += size;
+        ctx->jobs[f].size_source = size;
+        ctx->jobs[f].add = ctx->add_data || ctx->overlay_entries > 0;
+
+        pthread_mutex_unlock_wrapper(&ctx->jobs[f].jobmutex);
+        pool_submit(&ctx->jobs[f]);
+        pthread_mutex_unlock_wrapper(&ctx->jobdone_mutex);
+    }
 
-            assert(!(dst != dst_orig && f == -1));
+    return dst - dst_orig;
+}
 
-            if (f == -1) {
-                pthread_cond_wait_wrapper(&jobdone_cond, &jobdone_mutex);
-            }
-        } while (f == -1);
+// Adds size bytes of zeros to the payload without reading or hashing them, such as a hole in a sparse file. The fill
+// packets are built here and the job is only used to deliver them in payload order
+size_t dup_compress_hole(dup_ctx *ctx, uint64_t size, unsigned char *dst, uint64_t *payloadreturned) {
+    char *dst_orig = reinterpret_cast<char *>(dst);
+    char *d = dst_orig;
+    *payloadreturned = 0;
+
+    if (size > 0) {
+        pthread_mutex_lock_wrapper(&ctx->jobdone_mutex);
+        int f = acquire_job(ctx, &d, payloadreturned);
+
+        unsigned char *p = ctx->jobs[f].destination;
+        for (uint64_t done = 0; done < size;) {
+            size_t len = static_cast<size_t>(minimum(size - done, DUP_MAX_FILL));
+            p += write_fill(len, 0, p);
+            done += len;
+        }
+        ctx->jobs[f].payload = ctx->global_payload;
+        ctx->global_payload += size;
+        ctx->count_payload += size;
+        ctx->jobs[f].size_source = size;
+        ctx->jobs[f].size_destination = p - ctx->jobs[f].destination;
+
+        pthread_mutex_unlock_wrapper(&ctx->jobs[f].jobmutex);
+        pthread_mutex_unlock_wrapper(&ctx->jobdone_mutex);
+    }
 
-        memcpy(jobs[f].source, src, size);
-        jobs[f].payload = global_payload;
-        global_payload += size;
-        count_payload += size;
-        jobs[f].size_source = size;
-        jobs[f].add = add_data;
+    return d - dst_orig;
+}
+
+// Adds size bytes to the payload that are a copy of past payload at payload, such as a file that is known to be
+// unchanged since the full backup. Like dup_compress_hole() the data is neither read nor hashed
+size_t dup_compress_reference(dup_ctx *ctx, uint64_t payload, uint64_t size, unsigned char *dst, uint64_t *payloadreturned) {
+    char *dst_orig = reinterpret_cast<char *>(dst);
+    char *d = dst_orig;
+    *payloadreturned = 0;
 
-        pthread_cond_signal_wrapper(&jobs[f].cond);
-        pthread_mutex_unlock_wrapper(&jobs[f].jobmutex);
-        pthread_mutex_unlock_wrapper(&jobdone_mutex);
+    if (size > 0) {
+        pthread_mutex_lock_wrapper(&ctx->jobdone_mutex);
+        int f = acquire_job(ctx, &d, payloadreturned);
+
+        unsigned char *p = ctx->jobs[f].destination;
+        for (uint64_t done = 0; done < size;) {
+            size_t len = static_cast<size_t>(minimum(size - done, DUP_MAX_FILL));
+            p += write_match(len, payload + done, p);
+            done += len;
+        }
+        ctx->jobs[f].payload = ctx->global_payload;
+        ctx->global_payload += size;
+        ctx->count_payload += size;
+        ctx->jobs[f].size_source = size;
+        ctx->jobs[f].size_destination = p - ctx->jobs[f].destination;
+
+        pthread_mutex_unlock_wrapper(&ctx->jobs[f].jobmutex);
+        pthread_mutex_unlock_wrapper(&ctx->jobdone_mutex);
     }
 
-    return dst - dst_orig;
+    return d - dst_orig;
 }
 
-size_t dup_compress(const void *src, unsigned char *dst, size_t size, uint64_t *payloadreturned) {
-    ins.push_back(size);
+struct dup_hash {
+    bool crypto;
+    blake3_hasher blake;
+    XXH3_state_t *xxh;
+};
+
+dup_hash *dup_hash_create(dup_ctx *ctx) {
+    dup_hash *h = new dup_hash();
+    h->crypto = ctx->crypto_hash;
+    if (h->crypto) {
+        char salt[sizeof(ctx->hash_salt)];
+        ll2str(ctx->hash_salt, salt, sizeof(ctx->hash_salt));
+        blake3_hasher_init(&h->blake);
+        blake3_hasher_update(&h->blake, salt, sizeof(salt));
+    } else {
+        h->xxh = XXH3_createState();
+        XXH3_128bits_reset_withSeed(h->xxh, ctx->hash_salt);
+    }
+    return h;
+}
+
+void dup_hash_update(dup_hash *h, const void *src, size_t len) {
+    if (h->crypto) {
+        blake3_hasher_update(&h->blake, src, len);
+    } else {
+        XXH3_128bits_update(h->xxh, src, len);
+    }
+}
+
+void dup_hash_digest(dup_hash *h, unsigned char *dst) {
+    if (h->crypto) {
+        uint8_t output[BLAKE3_OUT_LEN];
+        blake3_hasher_finalize(&h->blake, output, BLAKE3_OUT_LEN);
+        memcpy(dst, output, DUP_HASH_SIZE);
+    } else {
+        XXH128_hash_t hash = XXH3_128bits_digest(h->xxh);
+        memcpy(dst, &hash, DUP_HASH_SIZE);
+        XXH3_freeState(h->xxh);
+    }
+    delete h;
+}
+
+size_t dup_compress(dup_ctx *ctx, const void *src, unsigned char *dst, size_t size, uint64_t *payloadreturned) {
     size_t len, s = 0, d = 0;
     do {
         len = (size > DUP_MAX_INPUT ? DUP_MAX_INPUT : size);
-        d += dup_compress2(static_cast<const char *>(src) + s, reinterpret_cast<char *>(dst) + d, len, payloadreturned);
+        d += dup_compress2(ctx, static_cast<const char *>(src) + s, reinterpret_cast<char *>(dst) + d, len, payloadreturned);
         s += len;
     } while (s < size);
 
-    outs.push_back(*payloadreturned);
-
     return d;
 }
+
+// Compatibility interface that runs a single session in a process-wide default context
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+dup_ctx default_ctx;
+
+int dup_init(size_t large_block, size_t small_block, uint64_t mem, int thread_count, void *space, int compression_level, bool crypto_hash, uint64_t hash_seed,
+             bool compact) {
+    return init_ctx(&default_ctx, large_block, small_block, mem, thread_count, space, compression_level, crypto_hash, hash_seed, compact);
+}
+
+void dup_deinit(void) { deinit_ctx(&default_ctx); }
+
+size_t dup_compress(const void *src, unsigned char *dst, size_t size, uint64_t *payloadreturned) {
+    return dup_compress(&default_ctx, src, dst, size, payloadreturned);
+}
+
+size_t dup_compress_hole(uint64_t size, unsigned char *dst, uint64_t *payloadreturned) { return dup_compress_hole(&default_ctx, size, dst, payloadreturned); }
+
+size_t dup_compress_reference(uint64_t payload, uint64_t size, unsigned char *dst, uint64_t *payloadreturned) {
+    return dup_compress_reference(&default_ctx, payload, size, dst, payloadreturned);
+}
+
+dup_hash *dup_hash_create(void) { return dup_hash_create(&default_ctx); }
+
+int dup_decompress(const unsigned char *src, unsigned char *dst, size_t *length, uint64_t *payload) {
+    return dup_decompress(&default_ctx, src, dst, length, payload);
+}
+
+void dup_counters_reset(void) { dup_counters_reset(&default_ctx); }
+
+uint64_t dup_counter_payload(void) { return dup_counter_payload(&default_ctx); }
+
+uint64_t dup_counter_compressed(void) { return dup_counter_compressed(&default_ctx); }
+
+void dup_add(bool add) { dup_add(&default_ctx, add); }
+
+void dup_overlay(void *space, uint64_t mem) { dup_overlay(&default_ctx, space, mem); }
+
+void dup_set_payload(uint64_t payload) { dup_set_payload(&default_ctx, payload); }
+
+size_t dup_compress_hashtable(void) { return dup_compress_hashtable(&default_ctx); }
+
+int dup_decompress_hashtable(size_t len) { return dup_decompress_hashtable(&default_ctx, len); }
+
+uint64_t dup_get_flushed(void) { return dup_get_flushed(&default_ctx); }
+
+size_t flush_pend(char *dst, uint64_t *payloadreturned) { return flush_pend(&default_ctx, dst, payloadreturned); }
+
+uint64_t large_hits() { return default_ctx.largehits; }
+
+uint64_t small_hits() { return default_ctx.smallhits; }
+
+size_t dup_pack_bound(size_t len) { return ZSTD_compressBound(len); }
+
+size_t dup_pack(const void *src, size_t len, void *dst, size_t dst_len, int level) {
+    size_t r = ZSTD_compress(dst, dst_len, src, len, level);
+    return ZSTD_isError(r) ? 0 : r;
+}
+
+size_t dup_unpack(const void *src, size_t len, void *dst, size_t dst_len) {
+    size_t r = ZSTD_decompress(dst, dst_len, src, len);
+    return ZSTD_isError(r) ? static_cast<size_t>(-1) : r;
+}
@@ -9,12 +9,35 @@
 #include <string.h>
 
 uint64_t dup_memory(uint64_t bits);
+// Memory for dup_init() and dup_overlay(). They clear any other memory they
+// are passed, but a table from dup_table_alloc() is zero already and is
+// cleared only if it's passed again. It's backed by huge pages where
+// supported, and interleaved across NUMA nodes if interleave is set and there
+// is more than one. placement, if set, receives the DUP_TABLE_ bits of what
+// was obtained. Release it with dup_table_free() after dup_deinit()
+#define DUP_TABLE_HUGETLB 1     // explicit huge pages
+#define DUP_TABLE_THP 2         // transparent huge pages were requested
+#define DUP_TABLE_INTERLEAVED 4 // interleaved across NUMA nodes
+void *dup_table_alloc(uint64_t mem, bool interleave, int *placement);
+void dup_table_free(void *table, uint64_t mem);
+// compact selects 16-byte table entries (exdupe -k). It defaults to the
+// full-size entries that callers got before it existed
 int dup_init(size_t large_block, size_t small_block, uint64_t memory_usage,
 	     int max_threadcount, void *memory, int compression_level,
-	     bool crypto_hash, uint64_t hash_seed);
+	     bool crypto_hash, uint64_t hash_seed, bool compact = false);
 
 size_t dup_compress(const void *src, unsigned char *dst, size_t size,
 		    uint64_t *payloadreturned);
+// Adds size bytes of zeros to the payload without reading them (holes in
+// sparse files). Output is delivered in order, like dup_compress()
+size_t dup_compress_hole(uint64_t size, unsigned char *dst,
+			 uint64_t *payloadreturned);
+// Adds size bytes to the payload that are a copy of the past payload at
+// payload, without reading them (files unchanged since the full backup)
+size_t dup_compress_reference(uint64_t payload, uint64_t size,
+			      unsigned char *dst, uint64_t *payloadreturned);
+// Returns 0 if literal data was written to dst, 1 for a reference to *length bytes of past
+// payload at *payload, and 2 for a run of *length bytes of the value *payload (not written to dst)
 int dup_decompress(const unsigned char *src, unsigned char *dst, size_t *length,
 		   uint64_t *payload);
 int dup_decompress_simulate(const unsigned char *src, size_t *length,
@@ -28,6 +51,13 @@ uint64_t dup_counter_payload(void);
 uint64_t dup_counter_compressed(void);
 
 void dup_add(bool add);
+// Layers a writable table of mem bytes on top of the hashtable, that payload is
+// indexed in while dup_add(false), so that it is also deduplicated against
+// itself. space must be zero-initialized like that of dup_init()
+void dup_overlay(void *space, uint64_t mem);
+// Starts the payload at payload instead of 0, so that a backup can continue the
+// payload of the archives it is based on. Call before any data is added
+void dup_set_payload(uint64_t payload);
 size_t dup_compress_hashtable(void);
 int dup_decompress_hashtable(size_t len);
 void dup_deinit(void);
@@ -40,4 +70,55 @@ size_t flush_pend(char *dst, uint64_t *payloadreturned);
 uint64_t larges();
 uint64_t smalls();
 
+// Plain zstd compression of a buffer, for the archive meta data. dup_pack()
+// returns 0 and dup_unpack() returns (size_t)-1 on error
+size_t dup_pack_bound(size_t len);
+size_t dup_pack(const void *src, size_t len, void *dst, size_t dst_len,
+		int level);
+size_t dup_unpack(const void *src, size_t len, void *dst, size_t dst_len);
+
+// Streaming hash of a whole file, with the function and salt that blocks are
+// verified with (BLAKE3 if dup_init() got crypto_hash, else xxHash128).
+// dup_hash_digest() writes DUP_HASH_SIZE bytes and frees the state
+#define DUP_HASH_SIZE 16
+typedef struct dup_hash dup_hash;
+dup_hash *dup_hash_create(void);
+void dup_hash_update(dup_hash *h, const void *src, size_t len);
+void dup_hash_digest(dup_hash *h, unsigned char *dst);
+
+// Reentrant interface. Each context is an independent deduplication session
+// with its own hashtable and payload counters, and may be used from its own
+// thread. All contexts share one pool of worker threads. The functions above
+// operate on a process-wide default context. A context that is only used for
+// decompression can be created with 0 memory, NULL space and 0 threads
+typedef struct dup_ctx dup_ctx;
+
+int dup_create(dup_ctx **ctx, size_t large_block, size_t small_block,
+	       uint64_t memory_usage, int max_threadcount, void *memory,
+	       int compression_level, bool crypto_hash, uint64_t hash_seed,
+	       bool compact = false);
+void dup_destroy(dup_ctx *ctx);
+
+size_t dup_compress(dup_ctx *ctx, const void *src, unsigned char *dst,
+		    size_t size, uint64_t *payloadreturned);
+size_t dup_compress_hole(dup_ctx *ctx, uint64_t size, unsigned char *dst,
+			 uint64_t *payloadreturned);
+size_t dup_compress_reference(dup_ctx *ctx, uint64_t payload, uint64_t size,
+			      unsigned char *dst, uint64_t *payloadreturned);
+dup_hash *dup_hash_create(dup_ctx *ctx);
+int dup_decompress(dup_ctx *ctx, const unsigned char *src, unsigned char *dst,
+		   size_t *length, uint64_t *payload);
+
+void dup_counters_reset(dup_ctx *ctx);
+uint64_t dup_counter_payload(dup_ctx *ctx);
+uint64_t dup_counter_compressed(dup_ctx *ctx);
+
+void dup_add(dup_ctx *ctx, bool add);
+void dup_overlay(dup_ctx *ctx, void *space, uint64_t mem);
+void dup_set_payload(dup_ctx *ctx, uint64_t payload);
+size_t dup_compress_hashtable(dup_ctx *ctx);
+int dup_decompress_hashtable(dup_ctx *ctx, size_t len);
+uint64_t dup_get_flushed(dup_ctx *ctx);
+size_t flush_pend(dup_ctx *ctx, char *dst, uint64_t *payloadreturned);
+
 #endif
@@ -37,72 +37,130 @@ const char *readMemFile(lua_State *, void *ud, size_t *size) {
     return luaMF->text;
 }
 
-bool execute(STRING script2, STRING dir2, STRING file2, STRING name2, uint64_t size, STRING ext2, uint32_t attrib, tm *date) {
+namespace {
+// The filter is compiled once into a function that is kept in the registry of a Lua state that lives for the rest of
+// the process. Each call only sets the globals that describe the item
+lua_State *L = NULL;
+int filter = LUA_NOREF;
+STRING compiled;
+
+const char *prelude = "function contains(items, item)\n"
+                      "for _,v in pairs(items) do\n"
+                      "  if v == item then\n"
+                      "    return true\n"
+                      "  end\n"
+                      "end\n"
+                      "return false\n"
+                      "end\n";
+
+void compile(const STRING &script2) {
     string script = wstring2string(script2);
-    string dir = wstring2string(dir2);
-    string name = wstring2string(name2);
-    string ext = wstring2string(ext2);
-    string file = wstring2string(file2);
-
-    // Open the LUA state
-    lua_State *L = luaL_newstate();
-
+    if (L) {
+        lua_close(L);
+    }
+    L = luaL_newstate();
     luaL_openlibs(L);
+    abort(luaL_dostring(L, prelude) != 0, UNITXT("Internal error, Lua prelude"));
+
     luaMemFile luaMF;
+    luaMF.text = script.c_str();
+    luaMF.size = script.size();
 
-    dir = wstring2string(remove_delimitor(string2wstring(dir)));
-    file = wstring2string(remove_delimitor(string2wstring(file)));
+    int i = lua_load(L, readMemFile, &luaMF, "Lua filter program", NULL);
 
-    myReplaceSTR(dir, "\\", "\\\\");
-    myReplaceSTR(file, "\\", "\\\\");
+    if (i != 0) {
+        const char *err = lua_tostring(L, lua_gettop(L));
 
-    date->tm_yday = 0;
-    date->tm_isdst = -1;
+        abort(i != 0,
+              UNITXT("%s\n--------------------------\n%s\n---------------------"
+                     "-----\n"),
+              string2wstring(string(err)).c_str(), script2.c_str());
+    }
 
-    string s =
-        "dir = " + (dir == "" ? "ni" : "\"" + dir + "\"") + "\n" + "file = " + (file == "" ? "ni" : "\"" + file + "\"") + "\n" +
-        "name = " + (name == "" ? "ni" : "\"" + name + "\"") + "\n" + "size = " + wstring2string(str(size)) + "\n" +
-        "ext = " + (file == "" ? "ni" : "\"" + ext + "\"") + "\n" + "date = os.time{year=" + wstring2string(str(date->tm_year)) +
-        ", month=" + wstring2string(str(date->tm_mon)) + ", day=" + wstring2string(str(date->tm_mday)) + ", hour=" + wstring2string(str(date->tm_hour)) +
-        ", min=" + wstring2string(str(date->tm_min)) + ", sec=" + wstring2string(str(date->tm_min)) + "}" + "\n\n" +
+    filter = luaL_ref(L, LUA_REGISTRYINDEX);
+    compiled = script2;
+}
+
+void set_string(const char *global, const string &value) {
+    if (value == "") {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L, value.c_str(), value.size());
+    }
+    lua_setglobal(L, global);
+}
 
 #ifdef WINDOWS
-        "ARCHIVE = " + (attrib & FILE_ATTRIBUTE_ARCHIVE ? "true" : "false") + "\n" + "COMPRESSED = " + (attrib & FILE_ATTRIBUTE_COMPRESSED ? "true" : "false") +
-        "\n" + "DEVICE = " + (attrib & FILE_ATTRIBUTE_DEVICE ? "true" : "false") + "\n" +
-        "DIRECTORY = " + (attrib & FILE_ATTRIBUTE_DIRECTORY ? "true" : "false") + "\n" +
-        "ENCRYPTED = " + (attrib & FILE_ATTRIBUTE_ENCRYPTED ? "true" : "false") + "\n" + "HIDDEN = " + (attrib & FILE_ATTRIBUTE_HIDDEN ? "true" : "false") +
-        "\n" + "NORMAL = " + (attrib & FILE_ATTRIBUTE_NORMAL ? "true" : "false") + "\n" +
-        "NOT_CONTENT_INDEXED = " + (attrib & FILE_ATTRIBUTE_NOT_CONTENT_INDEXED ? "true" : "false") + "\n" +
-        "OFFLINE = " + (attrib & FILE_ATTRIBUTE_OFFLINE ? "true" : "false") + "\n" + "READONLY = " + (attrib & FILE_ATTRIBUTE_READONLY ? "true" : "false") +
-        "\n" + "REPARSE_POINT = " + (attrib & FILE_ATTRIBUTE_REPARSE_POINT ? "true" : "false") + "\n" +
-        "SPARSE_FILE = " + (attrib & FILE_ATTRIBUTE_SPARSE_FILE ? "true" : "false") + "\n" + "SYSTEM = " + (attrib & FILE_ATTRIBUTE_SYSTEM ? "true" : "false") +
-        "\n" + "TEMPORARY = " + (attrib & FILE_ATTRIBUTE_TEMPORARY ? "true" : "false") + "\n" +
-        "VIRTUAL = " + (attrib & FILE_ATTRIBUTE_VIRTUAL ? "true" : "false") + "\n\n" +
+void set_boolean(const char *global, bool value) {
+    lua_pushboolean(L, value);
+    lua_setglobal(L, global);
+}
 #endif
+} // namespace
 
-        "function contains(items, item)\n" + "for _,v in pairs(items) do\n" + "  if v == item then\n" + "    return true\n" + "  end\n" + "end\n" +
-        "return false\n" + "end\n\n" + script;
+bool execute(const STRING &script, const STRING &dir2, const STRING &file2, const STRING &name2, uint64_t size, const STRING &ext2, uint32_t attrib, tm *date) {
+    if (!L || script != compiled) {
+        compile(script);
+    }
 
-    luaMF.text = s.c_str();
-    luaMF.size = strlen(luaMF.text);
+    string dir = wstring2string(remove_delimitor(dir2));
+    string file = wstring2string(remove_delimitor(file2));
 
-    int i = lua_load(L, readMemFile, &luaMF, "Lua filter program", NULL);
+    set_string("dir", dir);
+    set_string("file", file);
+    set_string("name", wstring2string(name2));
+    // Files without an extension have an empty ext rather than nil
+    string ext = wstring2string(ext2);
+    if (file == "") {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L, ext.c_str(), ext.size());
+    }
+    lua_setglobal(L, "ext");
+    lua_pushinteger(L, static_cast<lua_Integer>(size));
+    lua_setglobal(L, "size");
+
+    // Same as os.time{year=, month=, day=, hour=, min=, sec=}
+    tm t = {};
+    t.tm_year = date->tm_year - 1900;
+    t.tm_mon = date->tm_mon - 1;
+    t.tm_mday = date->tm_mday;
+    t.tm_hour = date->tm_hour;
+    t.tm_min = date->tm_min;
+    t.tm_sec = date->tm_sec;
+    t.tm_isdst = -1;
+    lua_pushinteger(L, static_cast<lua_Integer>(mktime(&t)));
+    lua_setglobal(L, "date");
 
-    if (i != 0) {
-        const char *err = lua_tostring(L, lua_gettop(L));
+#ifdef WINDOWS
+    set_boolean("ARCHIVE", attrib & FILE_ATTRIBUTE_ARCHIVE);
+    set_boolean("COMPRESSED", attrib & FILE_ATTRIBUTE_COMPRESSED);
+    set_boolean("DEVICE", attrib & FILE_ATTRIBUTE_DEVICE);
+    set_boolean("DIRECTORY", attrib & FILE_ATTRIBUTE_DIRECTORY);
+    set_boolean("ENCRYPTED", attrib & FILE_ATTRIBUTE_ENCRYPTED);
+    set_boolean("HIDDEN", attrib & FILE_ATTRIBUTE_HIDDEN);
+    set_boolean("NORMAL", attrib & FILE_ATTRIBUTE_NORMAL);
+    set_boolean("NOT_CONTENT_INDEXED", attrib & FILE_ATTRIBUTE_NOT_CONTENT_INDEXED);
+    set_boolean("OFFLINE", attrib & FILE_ATTRIBUTE_OFFLINE);
+    set_boolean("READONLY", attrib & FILE_ATTRIBUTE_READONLY);
+    set_boolean("REPARSE_POINT", attrib & FILE_ATTRIBUTE_REPARSE_POINT);
+    set_boolean("SPARSE_FILE", attrib & FILE_ATTRIBUTE_SPARSE_FILE);
+    set_boolean("SYSTEM", attrib & FILE_ATTRIBUTE_SYSTEM);
+    set_boolean("TEMPORARY", attrib & FILE_ATTRIBUTE_TEMPORARY);
+    set_boolean("VIRTUAL", attrib & FILE_ATTRIBUTE_VIRTUAL);
+#else
+    (void)attrib;
+#endif
 
-        abort(i != 0,
-              UNITXT("%s\n--------------------------\n%s\n---------------------"
-                     "-----\n"),
-              string2wstring(string(err)).c_str(), string2wstring(s).c_str());
+    lua_rawgeti(L, LUA_REGISTRYINDEX, filter);
+    if (lua_pcall(L, 0, 1, 0) != 0) {
+        const char *err = lua_tostring(L, -1);
+        abort(true, UNITXT("Error in Lua filter program: %s"), string2wstring(string(err ? err : "")).c_str());
     }
 
-    lua_call(L, 0, 1);
-
     // There was no error
     // Let's get the result from the stack
     bool result = (bool)lua_toboolean(L, lua_gettop(L));
     lua_pop(L, 1);
-    lua_close(L);
     return result;
 }
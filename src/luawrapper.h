@@ -11,4 +11,5 @@
 #include <string>
 
 using std::wstring;
-bool execute(STRING script2, STRING dir2, STRING file2, STRING name2, uint64_t size, STRING ext2, uint32_t attrib, tm *date);
+// Runs the -f filter script for a file or directory. The script is compiled on the first call and kept for the next
+bool execute(const STRING &script, const STRING &dir, const STRING &file, const STRING &name, uint64_t size, const STRING &ext, uint32_t attrib, tm *date);
@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// eXdupe deduplication library and file archiver.
+//
+// Copyrights:
+// 2010 - 2024: Lasse Mikkel Reinhold
+
+#include "readahead.hpp"
+#include "io.hpp"
+
+ReadAhead::ReadAhead(int threads, size_t max_bytes, size_t chunk_size, int cache_mode)
+    : m_max_bytes(max_bytes), m_chunk_size(chunk_size), m_cache_mode(cache_mode) {
+    for (int i = 0; i < threads; i++) {
+        m_threads.emplace_back(&ReadAhead::worker, this);
+    }
+}
+
+ReadAhead::~ReadAhead() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_work.notify_all();
+    for (auto &t : m_threads) {
+        t.join();
+    }
+    for (auto &c : m_chunks) {
+        if (c.data) {
+            Cio::free_aligned(c.data);
+        }
+    }
+    for (auto b : m_free) {
+        Cio::free_aligned(b);
+    }
+}
+
+void ReadAhead::add(const STRING &path, uint64_t size) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_files.push_back({path, size});
+    refill();
+}
+
+// Caller must hold m_mutex for the private functions below. A chunk is always allowed when none are queued, so that a
+// budget below chunk_size still reads ahead
+void ReadAhead::refill() {
+    bool added = false;
+    while (m_fill < m_files.size()) {
+        file_t &f = m_files[m_fill];
+        if (f.scheduled >= f.size) {
+            m_fill++;
+            continue;
+        }
+        size_t len = minimum(f.size - f.scheduled, m_chunk_size);
+        if (!m_chunks.empty() && m_queued_bytes + buffer_size(len) > m_max_bytes) {
+            break;
+        }
+        chunk_t c;
+        c.path = f.path;
+        c.offset = f.scheduled;
+        c.len = len;
+        f.scheduled += c.len;
+        m_queued_bytes += buffer_size(len);
+        m_chunks.push_back(std::move(c));
+        added = true;
+    }
+    if (added) {
+        m_work.notify_all();
+    }
+}
+
+void ReadAhead::pop_chunk(std::unique_lock<std::mutex> &lock) {
+    // A thread may still be writing into the chunk
+    m_done.wait(lock, [&] { return m_chunks.front().state != READING; });
+    chunk_t &c = m_chunks.front();
+    if (c.data && buffer_size(c.len) == buffer_size(m_chunk_size)) {
+        m_free.push_back(c.data);
+    } else if (c.data) {
+        Cio::free_aligned(c.data);
+    }
+    m_queued_bytes -= buffer_size(c.len);
+    m_chunks.pop_front();
+    m_queued = m_queued > 0 ? m_queued - 1 : 0;
+    refill();
+}
+
+// Stops reading a file ahead. Its chunks that are already queued are completed as empty so that get() rejects them
+void ReadAhead::drop_file(const STRING &path) {
+    for (auto &f : m_files) {
+        if (f.path == path) {
+            f.size = f.scheduled;
+        }
+    }
+    for (auto &c : m_chunks) {
+        if (c.path == path && c.state == QUEUED) {
+            c.state = DONE;
+            c.got = 0;
+        }
+    }
+}
+
+void ReadAhead::worker() {
+    Cio io;
+    STRING open_path;
+    FILE *file = nullptr;
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+        chunk_t *c = nullptr;
+        m_work.wait(lock, [&] {
+            for (; m_queued < m_chunks.size(); m_queued++) {
+                if (m_chunks[m_queued].state == QUEUED) {
+                    c = &m_chunks[m_queued++];
+                    return true;
+                }
+            }
+            return m_exit;
+        });
+        if (m_exit) {
+            break;
+        }
+
+        c->state = READING;
+        STRING path = c->path;
+        uint64_t offset = c->offset;
+        size_t len = c->len;
+        size_t size = buffer_size(len);
+        unsigned char *data = nullptr;
+        if (size == buffer_size(m_chunk_size) && !m_free.empty()) {
+            data = m_free.back();
+            m_free.pop_back();
+        }
+        lock.unlock();
+
+        if (!data) {
+            data = Cio::alloc_aligned(size);
+            abort(!data, UNITXT("Out of memory. Reduce -b flag"));
+        }
+
+        bool fail = false;
+        if (path != open_path) {
+            if (file) {
+                io.close(file);
+            }
+            open_path = path;
+            file = io.open(path, 'r');
+            // Holes are skipped by compress_file(), so reading sparse files ahead would only read zeros
+            fail = !file || io.sparse(file);
+            if (fail && file) {
+                io.close(file);
+                file = nullptr;
+            }
+            if (file) {
+                io.cache_sequential(file, m_cache_mode);
+            }
+        } else {
+            fail = !file;
+        }
+
+        size_t got = 0;
+        if (!fail) {
+            // O_DIRECT needs a multiple of the alignment. The chunk offsets are aligned already
+            size_t request = m_cache_mode == CACHE_DIRECT ? size : len;
+            got = minimum(io.read_at(file, offset, data, request), len);
+            if (m_cache_mode == CACHE_DROP) {
+                io.cache_drop(file, offset, got);
+            }
+        }
+        checksum_part_t part;
+        if (got == len) {
+            checksum_part(data, len, &part);
+        }
+
+        lock.lock();
+        c->data = data;
+        c->got = got;
+        c->part = part;
+        c->state = DONE;
+        if (fail || got != len) {
+            drop_file(path);
+        }
+        m_done.notify_all();
+    }
+
+    if (file) {
+        io.close(file);
+    }
+}
+
+// Copies the len bytes at offset of path into dst, and their checksum into part if set, and returns true if they were
+// read ahead. Else the caller must read them itself. Chunks of files added before path, and chunks of path before offset, are discarded because the caller
+// has skipped them
+bool ReadAhead::get(const STRING &path, uint64_t offset, size_t len, unsigned char *dst, checksum_part_t *part) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    size_t i = 0;
+    while (i < m_files.size() && m_files[i].path != path) {
+        i++;
+    }
+    if (i == m_files.size() || len == 0) {
+        return false;
+    }
+
+    while (!m_chunks.empty() && m_chunks.front().path != path) {
+        pop_chunk(lock);
+    }
+    m_files.erase(m_files.begin(), m_files.begin() + i);
+    m_fill = m_fill > i ? m_fill - i : 0;
+
+    file_t &f = m_files.front();
+    while (!m_chunks.empty() && m_chunks.front().path == path && m_chunks.front().offset < offset) {
+        pop_chunk(lock);
+    }
+    if (m_chunks.empty() && f.scheduled < offset) {
+        f.scheduled = offset;
+        refill();
+    }
+
+    if (m_chunks.empty() || m_chunks.front().path != path || m_chunks.front().offset != offset || m_chunks.front().len != len) {
+        drop_file(path);
+        return false;
+    }
+
+    m_done.wait(lock, [&] { return m_chunks.front().state == DONE; });
+    chunk_t &c = m_chunks.front();
+    bool ok = c.got == len;
+    if (ok) {
+        memcpy(dst, c.data, len);
+        if (part) {
+            *part = c.part;
+        }
+    }
+    pop_chunk(lock);
+
+    if (offset + len >= f.size && m_files.front().path == path) {
+        m_files.pop_front();
+        m_fill = m_fill > 0 ? m_fill - 1 : 0;
+        refill();
+    }
+    return ok;
+}
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// eXdupe deduplication library and file archiver.
+//
+// Copyrights:
+// 2010 - 2024: Lasse Mikkel Reinhold
+
+#ifndef READAHEAD_HEADER
+#define READAHEAD_HEADER
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "io.hpp"
+#include "utilities.hpp"
+
+// Reads source files ahead of compress_file() on a pool of threads so that disk latency overlaps with deduplication.
+// Files are added in the order they will be compressed and are cut into chunk_size pieces at chunk_size aligned
+// offsets. Pieces are held until max_bytes of buffers are in use, across file boundaries. Each buffer is the size of
+// its piece rounded up to Cio::ALIGN, so many small files can be in flight at once. Reads that weren't prefetched, like
+// those of sparse files or after an error, fall back to the caller's own handle. cache_mode is the -d page cache policy;
+// buffers are aligned so that CACHE_DIRECT can use O_DIRECT. The threads also checksum the chunks they read, so get()
+// can hand out a checksum_part_t that the caller only has to combine
+class ReadAhead {
+  public:
+    ReadAhead(int threads, size_t max_bytes, size_t chunk_size, int cache_mode);
+    ~ReadAhead();
+    void add(const STRING &path, uint64_t size);
+    bool get(const STRING &path, uint64_t offset, size_t len, unsigned char *dst, checksum_part_t *part = nullptr);
+
+  private:
+    enum chunk_state { QUEUED, READING, DONE };
+
+    struct chunk_t {
+        STRING path;
+        uint64_t offset;
+        size_t len;
+        size_t got = 0;
+        chunk_state state = QUEUED;
+        unsigned char *data = nullptr;
+        checksum_part_t part;
+    };
+
+    struct file_t {
+        STRING path;
+        uint64_t size;
+        uint64_t scheduled = 0; // chunks have been created up to here
+    };
+
+    size_t buffer_size(size_t len) const { return (len + Cio::ALIGN - 1) / Cio::ALIGN * Cio::ALIGN; }
+    void refill();
+    void pop_chunk(std::unique_lock<std::mutex> &lock);
+    void drop_file(const STRING &path);
+    void worker();
+
+    size_t m_max_bytes;
+    size_t m_chunk_size;
+    size_t m_queued_bytes = 0; // buffer_size() of all chunks in m_chunks
+    int m_cache_mode;
+    vector<unsigned char *> m_free; // buffers of a full chunk_size, kept for reuse
+    std::mutex m_mutex;
+    std::condition_variable m_work;
+    std::condition_variable m_done;
+    std::deque<file_t> m_files;
+    std::deque<chunk_t> m_chunks;
+    size_t m_fill = 0;   // index into m_files of the next file to create chunks for
+    size_t m_queued = 0; // index into m_chunks that the QUEUED chunks begin at or after
+    std::vector<std::thread> m_threads;
+    bool m_exit = false;
+};
+
+#endif
@@ -5,6 +5,7 @@ using namespace boost::ut;
 #define TEST(name) ::boost::ut::detail::test{"test", name} = [=]() mutable
 
 #include <chrono>
+#include <limits>
 #include <thread>
 
 #include "../utilities.hpp"
@@ -95,6 +96,28 @@ TEST("checksum") {
         checksum((unsigned char *)"", 0, &t);
         expect(result == t.result);
     }
+
+    {
+        // Zeros without data
+        unsigned char zeros[100] = {0};
+        for (size_t head = 0; head < 10; head++) {
+            for (size_t len = 0; len < 30; len++) {
+                checksum_t t1;
+                checksum_init(&t1);
+                checksum((unsigned char *)"123456789", head, &t1);
+                checksum(zeros, len, &t1);
+                checksum((unsigned char *)"123456789", 9, &t1);
+
+                checksum_t t2;
+                checksum_init(&t2);
+                checksum((unsigned char *)"123456789", head, &t2);
+                checksum_zeros(len, &t2);
+                checksum((unsigned char *)"123456789", 9, &t2);
+
+                expect(t1.result == t2.result);
+            }
+        }
+    }
 };
 
 TEST("format_size") {
@@ -124,6 +147,122 @@ TEST("format_size") {
     expect(format_size(1024ull * 1024 * 1024 * 1024 * 1024) == "1.00 PB");
 };
 
+TEST("varint") {
+    vector<uint64_t> values = {0, 1, 127, 128, 300, 16383, 16384, 1ull << 32, std::numeric_limits<uint64_t>::max()};
+    vector<unsigned char> buf;
+    for (auto v : values) {
+        put_varint(buf, v);
+    }
+    expect(buf.size() == 1 + 1 + 1 + 2 + 2 + 2 + 3 + 5 + 10);
+
+    const unsigned char *src = buf.data();
+    for (auto v : values) {
+        uint64_t r;
+        expect(get_varint(src, buf.data() + buf.size(), r));
+        expect(r == v);
+    }
+    expect(src == buf.data() + buf.size());
+
+    // Truncated
+    uint64_t r;
+    src = buf.data() + buf.size() - 5;
+    expect(!get_varint(src, buf.data() + buf.size() - 1, r));
+};
+
+TEST("checksum_combine") {
+    vector<unsigned char> data(100003);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<unsigned char>(rnd64());
+    }
+
+    for (size_t piece : {8, 64, 4096, 65536}) {
+        for (size_t len : {0, 5, 8, 13, 4096, 100000, 100003}) {
+            checksum_t whole;
+            checksum_init(&whole);
+            checksum(data.data(), len, &whole);
+
+            checksum_t combined;
+            checksum_init(&combined);
+            bool ok = true;
+            for (size_t i = 0; i < len; i += piece) {
+                checksum_part_t p;
+                checksum_part(data.data() + i, minimum(len - i, piece), &p);
+                ok = ok && checksum_combine(&combined, &p);
+            }
+            expect(ok);
+            expect(combined.result == whole.result);
+        }
+    }
+
+    // Pieces can follow data added by checksum() and checksum_zeros() if it ends at a multiple of 8 bytes
+    checksum_t whole;
+    checksum_init(&whole);
+    checksum(data.data(), 24, &whole);
+    checksum_zeros(4096, &whole);
+    checksum(data.data() + 24, 1003, &whole);
+
+    checksum_t combined;
+    checksum_init(&combined);
+    checksum(data.data(), 24, &combined);
+    checksum_zeros(4096, &combined);
+    checksum_part_t p;
+    checksum_part(data.data() + 24, 1003, &p);
+    expect(checksum_combine(&combined, &p));
+    expect(combined.result == whole.result);
+
+    checksum(data.data(), 3, &combined);
+    expect(!checksum_combine(&combined, &p));
+};
+
+TEST("checksum_restored") {
+    vector<unsigned char> data(8 * 1024 * 1024 + 13);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<unsigned char>(rnd64());
+    }
+
+    // Lengths that don't divide evenly into slices, and slices that are a multiple of 8 bytes with a tail left over
+    for (size_t threads : {1, 2, 3, 8}) {
+        for (size_t len : {0, 5, 2 * 1024 * 1024, 3'000'001, 3'000'003, 7 * 1024 * 1024 + 5, 8 * 1024 * 1024 + 13}) {
+            checksum_t whole;
+            checksum_init(&whole);
+            checksum(data.data(), len, &whole);
+
+            checksum_t sliced;
+            checksum_init(&sliced);
+            checksum_restored(data.data(), len, &sliced, threads);
+            expect(sliced.result == whole.result);
+        }
+    }
+
+    // Following data that doesn't end at a multiple of 8 bytes
+    checksum_t whole;
+    checksum_init(&whole);
+    checksum(data.data(), data.size(), &whole);
+
+    checksum_t sliced;
+    checksum_init(&sliced);
+    checksum(data.data(), 3, &sliced);
+    checksum_restored(data.data() + 3, data.size() - 3, &sliced, 4);
+    expect(sliced.result == whole.result);
+};
+
+TEST("wildcard_match") {
+    expect(wildcard_match(UNITXT("/home/joe/cache"), UNITXT("/home/joe/cache")));
+    expect(!wildcard_match(UNITXT("/home/joe/cache"), UNITXT("/home/joe/cach")));
+    expect(!wildcard_match(UNITXT("/home/joe/cache"), UNITXT("/home/joe/cache/x")));
+    expect(wildcard_match(UNITXT("/home/*/cache"), UNITXT("/home/joe/cache")));
+    expect(wildcard_match(UNITXT("/home/*/cache"), UNITXT("/home//cache")));
+    expect(!wildcard_match(UNITXT("/home/*/cache"), UNITXT("/home/joe/x/cache")));
+    expect(wildcard_match(UNITXT("/tmp/*.tmp"), UNITXT("/tmp/a.b.tmp")));
+    expect(!wildcard_match(UNITXT("/tmp/*.tmp"), UNITXT("/tmp/a.tmp.x")));
+    expect(wildcard_match(UNITXT("/tmp/*a*b*"), UNITXT("/tmp/xxaybbz")));
+    expect(!wildcard_match(UNITXT("/tmp/*a*b"), UNITXT("/tmp/xxbya")));
+    expect(wildcard_match(UNITXT("/tmp/file?"), UNITXT("/tmp/file1")));
+    expect(!wildcard_match(UNITXT("/tmp/file?"), UNITXT("/tmp/file")));
+    expect(!wildcard_match(UNITXT("/tmp?x"), UNITXT("/tmp/x")));
+    expect(wildcard_match(UNITXT("/tmp/**"), UNITXT("/tmp/")));
+};
+
 // Todo, switch to Catch2 that has fixtures
 // Todo, write many more tests!
 
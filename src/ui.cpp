@@ -23,6 +23,12 @@ void Statusbar::update(status_t status, uint64_t read, uint64_t written, STRING
     bool v3 = m_verbose_level == 3;
     size_t maxpath = size_t(-1);
 
+    // Called for every file, so test the throttle before resolving the path
+    uint64_t f = GetTickCount() - m_last_file_print;
+    if (!no_delay && f < 1000 && !v3) {
+        return;
+    }
+
     bool can_resolve = abs_path(path).size() > 0;
 
     if (can_resolve && path != UNITXT("-stdin") && path != UNITXT("-stdout")) {
@@ -35,34 +41,30 @@ void Statusbar::update(status_t status, uint64_t read, uint64_t written, STRING
         path = remove_leading_delimitor(path);
     }
 
-    uint64_t f = GetTickCount() - m_last_file_print;
-
-    if ((no_delay || f >= 1000) || v3) {
-        m_last_file_print = GetTickCount();
-        STRING line;
-        if (backup) {
-            line = s2w(format_size(read)) + UNITXT(", ") + s2w(format_size(written)) + UNITXT(", ");
-        } else {
-            line = s2w(format_size(written)) + UNITXT(", ");
-        }
+    m_last_file_print = GetTickCount();
+    STRING line;
+    if (backup) {
+        line = s2w(format_size(read)) + UNITXT(", ") + s2w(format_size(written)) + UNITXT(", ");
+    } else {
+        line = s2w(format_size(written)) + UNITXT(", ");
+    }
 
-        if (!v3) {
-            maxpath = m_term_width - line.size();
-        }
+    if (!v3) {
+        maxpath = m_term_width - line.size();
+    }
 
-        if (m_verbose_level > 0) {
-            if (v3 && m_lastpath != path) {
-                m_lastpath = path;
-                line += path;
-                m_os << UNITXT("  ") << path << UNITXT("\n");
-            } else if (!v3) {
-                clear_line();
-                if (path.size() > maxpath) {
-                    path = path.substr(0, maxpath - 2) + UNITXT("..");
-                }
-                line += path;
-                m_os << line;
+    if (m_verbose_level > 0) {
+        if (v3 && m_lastpath != path) {
+            m_lastpath = path;
+            line += path;
+            m_os << UNITXT("  ") << path << UNITXT("\n");
+        } else if (!v3) {
+            clear_line();
+            if (path.size() > maxpath) {
+                path = path.substr(0, maxpath - 2) + UNITXT("..");
             }
+            line += path;
+            m_os << line;
         }
     }
 }
@@ -12,6 +12,11 @@
 #include <iomanip>
 #include <cmath>
 #include <cfenv>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "unicode.h"
 #include "utilities.hpp"
@@ -115,6 +120,17 @@ string wstring2string(STRING wstr) {
     return str;
 }
 
+string to_utf8(const STRING &str) {
+#ifdef WINDOWS
+    int n = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), static_cast<int>(str.size()), 0, 0, 0, 0);
+    string r(n, ' ');
+    WideCharToMultiByte(CP_UTF8, 0, str.c_str(), static_cast<int>(str.size()), r.data(), n, 0, 0);
+    return r;
+#else
+    return str;
+#endif
+}
+
 STRING string2wstring(string str) {
     STRING wstr(str.length(), L' ');
     copy(str.begin(), str.end(), wstr.begin());
@@ -381,6 +397,179 @@ void checksum(unsigned char *data, size_t len, checksum_t *t) {
     return;
 }
 
+// Same as checksum() of len zero bytes, but in constant time because a zero word adds nothing but its position
+void checksum_zeros(uint64_t len, checksum_t *t) {
+    if (len == 0) {
+        return;
+    }
+
+    while (t->remainder_len < 8 && len > 0) {
+        t->remainder = t->remainder >> 8;
+        t->remainder_len++;
+        len--;
+    }
+
+    if (t->remainder_len < 8) {
+        t->result = t->a_val + t->b_val + t->remainder + t->remainder_len;
+        return;
+    }
+
+    t->a_val += t->remainder * t->b_val;
+    t->b_val += 1 + len / 8;
+    t->remainder_len = len % 8;
+    t->remainder = 0;
+    t->result = t->a_val + t->b_val + t->remainder + t->remainder_len;
+}
+
+// Word i of a piece adds word * (b + i) to a_val of the file, where b is b_val at the start of the piece. So the piece
+// only needs the sum of its words and the sum of word * i
+void checksum_part(const unsigned char *data, size_t len, checksum_part_t *p) {
+    uint64_t sum = 0;
+    uint64_t weighted = 0;
+    uint64_t i = 0;
+    auto last_data = data + ((len / 8) * 8);
+    len -= ((len / 8) * 8);
+    while (data < last_data) {
+#ifdef X86X64
+        uint64_t l = *(uint64_t *)data;
+#else
+        uint64_t l = 0;
+        for (unsigned int j = 0; j < 8; j++) {
+            l = l >> 8;
+            l = l | (uint64_t) * (data + j) << (7 * 8);
+        }
+#endif
+        sum += l;
+        weighted += l * i;
+        i++;
+        data += 8;
+    }
+
+    p->sum = sum;
+    p->weighted = weighted;
+    p->words = i;
+    p->remainder = 0;
+    p->remainder_len = len;
+    while (len > 0) {
+        p->remainder = p->remainder >> 8;
+        p->remainder = p->remainder | (uint64_t)*data << (7 * 8);
+        data++;
+        len--;
+    }
+}
+
+bool checksum_combine(checksum_t *t, const checksum_part_t *p) {
+    if (t->remainder_len != 0) {
+        return false;
+    }
+    if (p->words == 0 && p->remainder_len == 0) {
+        return true;
+    }
+    t->a_val += t->b_val * p->sum + p->weighted;
+    t->b_val += p->words;
+    t->remainder = p->remainder;
+    t->remainder_len = p->remainder_len;
+    t->result = t->a_val + t->b_val + t->remainder + t->remainder_len;
+    return true;
+}
+
+namespace {
+// Threads that checksum slices of a buffer. They are started once and wait between calls, so that checksumming each
+// restored batch doesn't create and join threads of its own
+class ChecksumPool {
+  public:
+    explicit ChecksumPool(size_t threads) {
+        for (size_t i = 0; i < threads; i++) {
+            m_threads.emplace_back(&ChecksumPool::worker, this);
+        }
+    }
+
+    ~ChecksumPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_work.notify_all();
+        for (auto &t : m_threads) {
+            t.join();
+        }
+    }
+
+    size_t size() const { return m_threads.size(); }
+
+    // Calls job(i) for each i in [0, n) on the threads of the pool and the calling thread, and returns when all are done
+    void run(size_t n, const std::function<void(size_t)> &job) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_job = &job;
+        m_next = 0;
+        m_count = n;
+        m_done = 0;
+        m_work.notify_all();
+        take(lock);
+        m_finished.wait(lock, [&] { return m_done == m_count; });
+        m_job = nullptr;
+    }
+
+  private:
+    // Runs jobs of the current call until there are none left to start
+    void take(std::unique_lock<std::mutex> &lock) {
+        while (m_job && m_next < m_count) {
+            size_t i = m_next++;
+            const std::function<void(size_t)> *job = m_job;
+            lock.unlock();
+            (*job)(i);
+            lock.lock();
+            if (++m_done == m_count) {
+                m_finished.notify_all();
+            }
+        }
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_work.wait(lock, [&] { return m_exit || (m_job && m_next < m_count); });
+            if (m_exit) {
+                return;
+            }
+            take(lock);
+        }
+    }
+
+    vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_work;
+    std::condition_variable m_finished;
+    const std::function<void(size_t)> *m_job = nullptr;
+    size_t m_next = 0;
+    size_t m_count = 0;
+    size_t m_done = 0;
+    bool m_exit = false;
+};
+} // namespace
+
+void checksum_restored(unsigned char *data, size_t len, checksum_t *t, size_t threads) {
+    size_t slices = minimum(threads, len / (1024 * 1024));
+    if (slices < 2 || t->remainder_len != 0) {
+        checksum(data, len, t);
+        return;
+    }
+
+    static std::unique_ptr<ChecksumPool> pool;
+    if (!pool || pool->size() != threads - 1) {
+        pool.reset();
+        pool.reset(new ChecksumPool(threads - 1));
+    }
+
+    // All slices but the last are a multiple of 8 bytes so that they can be combined
+    size_t slice = len / slices / 8 * 8;
+    vector<checksum_part_t> parts(slices);
+    pool->run(slices, [&](size_t i) { checksum_part(data + i * slice, i + 1 == slices ? len - i * slice : slice, &parts[i]); });
+    for (auto &p : parts) {
+        checksum_combine(t, &p);
+    }
+}
+
 uint64_t filesize(STRING file, bool followlinks = false) {
 #ifndef WINDOWS
     struct stat buf;
@@ -816,3 +1005,71 @@ void tm_to_long(short_tm *s, tm *l) {
     l->tm_yday = s->tm_yday;
     l->tm_isdst = s->tm_isdst;
 }
+
+void put_varint(vector<unsigned char> &dst, uint64_t value) {
+    while (value >= 0x80) {
+        dst.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    dst.push_back(static_cast<unsigned char>(value));
+}
+
+bool get_varint(const unsigned char *&src, const unsigned char *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && src < end; shift += 7) {
+        unsigned char c = *src++;
+        value |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+// Classic greedy glob of a single path component with backtracking to the most recent *, linear for typical patterns
+bool match_component(const CHR *p, const CHR *pe, const CHR *s, const CHR *se) {
+    const CHR *star = nullptr;
+    const CHR *retry = nullptr;
+    while (s < se) {
+        if (p < pe && (*p == '?' || *p == *s)) {
+            p++;
+            s++;
+        } else if (p < pe && *p == '*') {
+            star = ++p;
+            retry = s;
+        } else if (star) {
+            p = star;
+            s = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (p < pe && *p == '*') {
+        p++;
+    }
+    return p == pe;
+}
+} // namespace
+
+bool wildcard_match(const STRING &pattern, const STRING &path) {
+#ifdef WINDOWS
+    const CHR *delimiters = UNITXT("/\\");
+#else
+    const CHR *delimiters = UNITXT("/");
+#endif
+    size_t p = 0;
+    size_t s = 0;
+    for (;;) {
+        size_t pe = min(pattern.find_first_of(delimiters, p), pattern.size());
+        size_t se = min(path.find_first_of(delimiters, s), path.size());
+        if (!match_component(pattern.data() + p, pattern.data() + pe, path.data() + s, path.data() + se)) {
+            return false;
+        }
+        if (pe == pattern.size() || se == path.size()) {
+            return pe == pattern.size() && se == path.size();
+        }
+        p = pe + 1;
+        s = se + 1;
+    }
+}
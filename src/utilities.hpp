@@ -68,6 +68,7 @@ uint64_t rnd64();
 
 STRING string2wstring(string str);
 string wstring2string(STRING wstr);
+string to_utf8(const STRING &str);
 
 void myReplaceSTR(std::string &str, const std::string &oldStr, const std::string &newStr);
 void myReplace(std::STRING &str, const std::STRING &oldStr, const std::STRING &newStr);
@@ -120,6 +121,24 @@ typedef struct {
 
 void checksum(unsigned char *data, size_t len, checksum_t *t);
 void checksum_init(checksum_t *t);
+void checksum_zeros(uint64_t len, checksum_t *t);
+
+// checksum() of a piece of a file that begins a multiple of 8 bytes into it, computed without the state in front of it.
+// Pieces can be checksummed on separate threads and then added to the checksum_t of the file in order. That gives the
+// same result as checksum() of their data if t is at a multiple of 8 bytes, else checksum_combine() returns false
+typedef struct {
+    uint64_t sum;      // of the 8 byte words
+    uint64_t weighted; // of each word times its index in the piece
+    uint64_t words;
+    uint64_t remainder; // trailing bytes that don't fill a word, as checksum_t holds them
+    uint64_t remainder_len;
+} checksum_part_t;
+
+void checksum_part(const unsigned char *data, size_t len, checksum_part_t *p);
+bool checksum_combine(checksum_t *t, const checksum_part_t *p);
+
+// Same as checksum() of the data, but computed in slices on up to the given number of threads if it's large enough
+void checksum_restored(unsigned char *data, size_t len, checksum_t *t, size_t threads);
 STRING abs_path(STRING source);
 bool exists(STRING file);
 bool is_dir(STRING path);
@@ -150,4 +169,13 @@ typedef struct {
 void tm_to_short(short_tm *s, tm *l);
 void tm_to_long(short_tm *s, tm *l);
 
+// LEB128 coding of integers for compact archive meta data. get_varint() advances src past the value and returns
+// false instead of reading past end
+void put_varint(vector<unsigned char> &dst, uint64_t value);
+bool get_varint(const unsigned char *&src, const unsigned char *end, uint64_t &value);
+
+// Matches a path against a pattern where * is any run of characters and ? is any single character. Neither spans a
+// path delimiter, so /home/*/cache matches /home/joe/cache but not /home/joe/x/cache
+bool wildcard_match(const STRING &pattern, const STRING &path);
+
 #endif
@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// eXdupe deduplication library and file archiver.
+//
+// Copyrights:
+// 2010 - 2024: Lasse Mikkel Reinhold
+
+#include "walker.hpp"
+
+#ifdef WINDOWS
+#define DELIM_STR UNITXT("\\")
+#else
+#include <fcntl.h>
+#define DELIM_STR UNITXT("/")
+#endif
+
+Walker::Walker(int threads, size_t max_prefetch, bool follow_symlinks, bool recursive, std::function<bool(const STRING &, const walk_entry_t &)> excluded)
+    : m_follow(follow_symlinks), m_recursive(recursive), m_max_prefetch(max_prefetch), m_excluded(excluded) {
+    if (!recursive) {
+        return;
+    }
+    for (int i = 0; i < threads; i++) {
+        m_threads.emplace_back(&Walker::worker, this);
+    }
+}
+
+Walker::~Walker() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_work.notify_all();
+    for (auto &t : m_threads) {
+        t.join();
+    }
+}
+
+#ifdef WINDOWS
+namespace {
+void find_data_to_entry(const WIN32_FIND_DATAW &data, walk_entry_t &e) {
+    SYSTEMTIME t;
+    FileTimeToSystemTime(&data.ftLastWriteTime, &t);
+    e.attributes = data.dwFileAttributes;
+    e.size = (uint64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    e.date.tm_hour = t.wHour;
+    e.date.tm_min = t.wMinute;
+    e.date.tm_mday = t.wDay;
+    e.date.tm_mon = t.wMonth;
+    e.date.tm_sec = t.wSecond;
+    e.date.tm_year = t.wYear;
+    e.date.tm_wday = t.wDayOfWeek;
+}
+} // namespace
+#else
+namespace {
+void stat_to_entry(const struct stat &s, walk_entry_t &e) {
+    // gmtime() has a shared result buffer and runs on several threads here
+    e.attributes = s.st_mode;
+    e.size = s.st_size;
+    e.dev = s.st_dev;
+    e.ino = s.st_ino;
+    e.links = s.st_nlink;
+    if (gmtime_r(&s.st_mtime, &e.date)) {
+        e.date.tm_year += 1900;
+    }
+}
+} // namespace
+#endif
+
+bool Walker::stat_path(const STRING &path, walk_entry_t &entry) const {
+#ifdef WINDOWS
+    entry.attributes = get_attributes(path, m_follow);
+    if (entry.attributes != -1) {
+        entry.size = filesize(path, m_follow);
+        get_date(path, &entry.date);
+    }
+    return entry.attributes != -1;
+#else
+    struct stat s;
+    if ((m_follow ? stat(path.c_str(), &s) : lstat(path.c_str(), &s)) < 0) {
+        entry.attributes = -1;
+        return false;
+    }
+    stat_to_entry(s, entry);
+    return true;
+#endif
+}
+
+bool Walker::read_dir(const STRING &dir, vector<walk_entry_t> &entries) const {
+#ifdef WINDOWS
+    WIN32_FIND_DATAW data;
+    STRING s = remove_delimitor(dir) + UNITXT("\\*");
+    HANDLE hFind = FindFirstFileW(s.c_str(), &data);
+
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return GetLastError() == ERROR_FILE_NOT_FOUND;
+    }
+    do {
+        if (STRING(data.cFileName) != UNITXT(".") && STRING(data.cFileName) != UNITXT("..")) {
+            walk_entry_t e;
+            e.name = data.cFileName;
+            find_data_to_entry(data, e);
+            entries.push_back(e);
+        }
+    } while (FindNextFileW(hFind, &data));
+    FindClose(hFind);
+    return true;
+#else
+    DIR *d = opendir(dir.c_str());
+    if (d == 0) {
+        return false;
+    }
+    int fd = dirfd(d);
+    struct dirent *entry;
+
+    while ((entry = readdir(d)) != 0) {
+        if (STRING(entry->d_name) == UNITXT(".") || STRING(entry->d_name) == UNITXT("..")) {
+            continue;
+        }
+        walk_entry_t e;
+        e.name = entry->d_name;
+        e.ino = entry->d_ino;
+
+        // Directories and unfollowed symlinks only need their type, so save the stat call
+        if (entry->d_type == DT_DIR) {
+            e.attributes = S_IFDIR;
+        } else if (entry->d_type == DT_LNK && !m_follow) {
+            e.attributes = S_IFLNK;
+        } else {
+            struct stat s;
+            if (fstatat(fd, entry->d_name, &s, m_follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+                stat_to_entry(s, e);
+            }
+        }
+        entries.push_back(e);
+    }
+    closedir(d);
+    return true;
+#endif
+}
+
+void Walker::release(listing_t &listing) {
+    // Caller must hold m_mutex. Drops the listing but remembers the position, which its own listing is based on
+    if (listing.state == QUEUED) {
+        m_queue.erase(listing.position);
+    }
+    if (listing.state != KNOWN) {
+        m_fetched.erase(listing.position);
+    }
+    listing.state = KNOWN;
+    listing.ok = false;
+    vector<walk_entry_t>().swap(listing.entries);
+}
+
+void Walker::erase(std::map<position_t, STRING>::iterator it) {
+    // Caller must hold m_mutex
+    auto l = m_listings.find(it->second);
+    release(l->second);
+    m_listings.erase(l);
+    m_order.erase(it);
+}
+
+void Walker::prefetch(const STRING &dir, const position_t &position, const vector<walk_entry_t> &entries) {
+    // Caller must hold m_mutex
+    bool added = false;
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        const walk_entry_t &e = entries[i];
+        bool dir_link = false;
+#ifdef WINDOWS
+        dir_link = e.attributes != -1 && ISLINK(e.attributes);
+#endif
+        if (e.attributes != -1 && ISDIR(e.attributes) && !dir_link) {
+            STRING key = remove_delimitor(dir) + DELIM_STR + e.name;
+            if (!m_listings.contains(key) && !(m_excluded && m_excluded(key, e))) {
+                listing_t &l = m_listings[key];
+                l.position = position;
+                l.position.push_back(i);
+                l.state = QUEUED;
+                m_order[l.position] = key;
+                m_queue.insert(l.position);
+                m_fetched.insert(l.position);
+                added = true;
+            }
+        }
+    }
+
+    // Forget the listings that are furthest away in traversal order, together with what is known below them. They are
+    // listed synchronously when reached
+    while (m_fetched.size() > m_max_prefetch && m_position < *m_fetched.rbegin()) {
+        position_t last = *m_fetched.rbegin();
+        auto it = m_order.find(last);
+        release(m_listings[it->second]);
+        for (++it; it != m_order.end() && it->first.size() > last.size() && std::equal(last.begin(), last.end(), it->first.begin());) {
+            auto next = std::next(it);
+            erase(it);
+            it = next;
+        }
+    }
+
+    if (added) {
+        m_work.notify_all();
+    }
+}
+
+void Walker::worker() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_work.wait(lock, [&] { return m_exit || !m_queue.empty(); });
+        if (m_exit) {
+            return;
+        }
+        position_t position = *m_queue.begin();
+        m_queue.erase(m_queue.begin());
+        STRING dir = m_order[position];
+        m_listings[dir].state = READING;
+
+        lock.unlock();
+        vector<walk_entry_t> entries;
+        bool ok = read_dir(dir, entries);
+        lock.lock();
+
+        auto it = m_listings.find(dir);
+        if (it == m_listings.end() || it->second.state != READING) {
+            // Passed or dropped in the meantime
+            continue;
+        }
+        it->second.ok = ok;
+        it->second.entries = std::move(entries);
+        it->second.state = DONE;
+        if (ok) {
+            prefetch(dir, position, it->second.entries);
+        }
+        m_done.notify_all();
+    }
+}
+
+bool Walker::list(const STRING &dir, vector<walk_entry_t> &entries) {
+    STRING key = remove_delimitor(dir);
+    bool ok = false;
+    bool found = false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_listings.find(key);
+    // Directories that weren't seen in a listing are the ones given on the command line, which come in order
+    position_t position = it != m_listings.end() ? it->second.position : position_t{m_roots++};
+    m_position = position;
+
+    // Everything before this position was skipped by compress(), such as directories excluded by -f or --exclude
+    while (!m_order.empty() && m_order.begin()->first < position) {
+        erase(m_order.begin());
+    }
+
+    if (it != m_listings.end()) {
+        // A QUEUED listing hasn't been picked up by a thread yet; cheaper to list it here than to wait
+        m_done.wait(lock, [&] { return it->second.state != READING; });
+        if (it->second.state == DONE) {
+            ok = it->second.ok;
+            entries = std::move(it->second.entries);
+            found = true;
+        }
+        erase(m_order.find(position));
+    }
+
+    if (!found) {
+        lock.unlock();
+        ok = read_dir(dir, entries);
+        lock.lock();
+    }
+
+    if (ok && m_recursive && !m_threads.empty()) {
+        prefetch(key, position, entries);
+    }
+    return ok;
+}
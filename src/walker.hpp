@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// eXdupe deduplication library and file archiver.
+//
+// Copyrights:
+// 2010 - 2024: Lasse Mikkel Reinhold
+
+#ifndef WALKER_HEADER
+#define WALKER_HEADER
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <time.h>
+
+#include "utilities.hpp"
+
+// Metadata of a directory entry. Gathered with at most one stat call per entry, and none at all for directories and
+// symlinks whose type is known from the directory listing
+struct walk_entry_t {
+    STRING name;
+    int attributes = -1; // same as get_attributes(), -1 if the entry could not be accessed
+    uint64_t size = 0;
+    tm date{}; // same as get_date()
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t links = 1; // hard links to the inode. Always 1 on Windows, where the directory listing doesn't tell
+};
+
+// Lists directories ahead of the depth-first traversal in compress(). Each listing that is handed out queues its sub
+// directories for a pool of threads, which list and stat them in the background. The caller still asks for listings
+// in its own order, so the archive layout never depends on thread timing. Sub directories for which excluded() returns
+// true are never listed ahead. It is called from the threads with the walker locked. Listings that the traversal has
+// moved past, such as directories that compress() skipped, are dropped when the next directory is asked for
+class Walker {
+  public:
+    Walker(int threads, size_t max_prefetch, bool follow_symlinks, bool recursive,
+           std::function<bool(const STRING &, const walk_entry_t &)> excluded = nullptr);
+    ~Walker();
+    bool list(const STRING &dir, vector<walk_entry_t> &entries);
+    bool stat_path(const STRING &path, walk_entry_t &entry) const;
+
+  private:
+    // Place in the depth-first traversal: the index of the directory in each listing on the way down to it. Compares
+    // lexicographically in the order that compress() visits directories, which is listing order
+    typedef vector<uint32_t> position_t;
+
+    enum state_t { KNOWN, QUEUED, READING, DONE };
+
+    struct listing_t {
+        position_t position;
+        state_t state = KNOWN;
+        bool ok = false;
+        vector<walk_entry_t> entries;
+    };
+
+    bool read_dir(const STRING &dir, vector<walk_entry_t> &entries) const;
+    void prefetch(const STRING &dir, const position_t &position, const vector<walk_entry_t> &entries);
+    void release(listing_t &listing);
+    void erase(std::map<position_t, STRING>::iterator it);
+    void worker();
+
+    bool m_follow;
+    bool m_recursive;
+    size_t m_max_prefetch;
+    std::function<bool(const STRING &, const walk_entry_t &)> m_excluded;
+    std::mutex m_mutex;
+    std::condition_variable m_work;
+    std::condition_variable m_done;
+    std::map<STRING, listing_t> m_listings; // sub directories of listed directories that the traversal hasn't reached
+    std::map<position_t, STRING> m_order;   // same, by position
+    std::set<position_t> m_queue;           // QUEUED, nearest first
+    std::set<position_t> m_fetched;         // QUEUED, READING or DONE, at most m_max_prefetch
+    position_t m_position;                  // of the directory last asked for by list()
+    uint32_t m_roots = 0;
+    std::vector<std::thread> m_threads;
+    bool m_exit = false;
+};
+
+#endif